@@ -1,6 +1,6 @@
 /**
  *  Aho-Corasick search framework
- *  compiles as linux kernel module for SMP or as single-thread userspace library
+ *  compiles as linux kernel module for SMP or as multi-thread userspace library
  *  compiles with modified multifast-v1.4.2 (C) Kamiar Kanani <kamiar.kanani@gmail.com>
  *  (C) 2015 Ilya Gavrilov <gilyav@gmail.com>
  *
@@ -15,19 +15,38 @@
 #include <linux/smp.h>
 #include <linux/cpumask.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
 #include <linux/printk.h>
+#include <linux/skbuff.h>
+#include <linux/llist.h>
+#include <linux/bottom_half.h>
+#include <linux/percpu.h>
+#include <linux/cpu.h>
+#include <linux/cpuhotplug.h>
+#include <linux/mutex.h>
+#include <linux/mempool.h>
+#include <linux/percpu-refcount.h>
+#include <linux/moduleparam.h>
 #define AC_ERROR(x...) printk(x)
 /*#define AC_ERROR_RATELIMIT(x...) printk_ratelimited(KERN_INFO x)*/
 #define AC_ERROR_RATELIMIT(x...) printk(x)
 #define AC_PRINT(x...) printk(x)
 #define AC_DEBUG(x...) /*{printk("ac_module debug: ");printk(x);}*/
 #else
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stdint.h>
 #include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #define AC_ERROR(x...) printf(x)
 #define AC_ERROR_RATELIMIT(x...) printf(x)
 #define AC_PRINT(x...) printf(x)
@@ -37,338 +56,1205 @@
 
 #include "list.h"
 #include "ahocorasick.h"
+#include "actable.h"
 #include "ac_module.h"
 
 #ifndef __KERNEL__
+/*
+ * userspace slots stand for cpus: a thread is mapped to slot on first use
+ * (round-robin), threads sharing a slot are serialized by its bh lock
+ */
 int nr_cpu_ids = 1;
-int get_cpu() { return 0; }
-void put_cpu() {}
+static atomic_int ac_slot_next;
+static __thread int ac_slot = -1;
+int smp_processor_id(void)
+{
+	if(ac_slot < 0)
+		ac_slot = atomic_fetch_add_explicit(&ac_slot_next, 1, memory_order_relaxed);
+	return ac_slot % nr_cpu_ids;
+}
+int get_cpu(void) { return smp_processor_id(); }
+void put_cpu(void) {}
+void cpus_read_lock(void) {}
+void cpus_read_unlock(void) {}
+#define for_each_online_cpu(cpu) for((cpu) = 0; (cpu) < nr_cpu_ids; (cpu)++)
+
+/* per cpu data is an array of nr_cpu_ids cache line aligned entries */
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(SMP_CACHE_BYTES)))
+#define __percpu
+#define alloc_percpu(type) ((type *)__ac_alloc_percpu(sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) ((ptr) + (cpu))
+#define this_cpu_ptr(ptr) per_cpu_ptr((ptr), smp_processor_id())
+#define DEFINE_PER_CPU(type, name) type name[AC_THREADS_MAX]
+#define per_cpu(var, cpu) ((var)[cpu])
+/* a slot may be shared by threads, its counters are added atomically */
+#define __ac_slot_add(ptr, val) __atomic_fetch_add((ptr), (val), __ATOMIC_RELAXED)
+#define this_cpu_add(pcp, val) __ac_slot_add(&per_cpu(pcp, smp_processor_id()), (val))
+#define for_each_possible_cpu(cpu) for_each_online_cpu(cpu)
+static void *__ac_alloc_percpu(size_t size)
+{
+	void *ptr;
+
+	if(posix_memalign(&ptr, SMP_CACHE_BYTES, size * nr_cpu_ids))
+		return NULL;
+	memset(ptr, 0, size * nr_cpu_ids);
+	return ptr;
+}
+
+/*
+ * slot locks: bh lock makes the slot owner the only consumer of its free
+ * stacks, rcu lock is read locked by readers of the slot and write locked
+ * by grace period
+ */
+struct ac_slot {
+	pthread_mutex_t bh;
+	pthread_rwlock_t rcu;
+} ____cacheline_aligned_in_smp;
+static struct ac_slot ac_slots[AC_THREADS_MAX] = {
+	[0 ... AC_THREADS_MAX - 1] = {
+		PTHREAD_MUTEX_INITIALIZER,
+		PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP
+	}
+};
+void local_bh_disable(void) { pthread_mutex_lock(&ac_slots[smp_processor_id()].bh); }
+void local_bh_enable(void) { pthread_mutex_unlock(&ac_slots[smp_processor_id()].bh); }
+
+typedef pthread_mutex_t spinlock_t;
+#define spin_lock_init(lock) pthread_mutex_init((lock), NULL)
+#define spin_lock_bh(lock) pthread_mutex_lock(lock)
+#define spin_unlock_bh(lock) pthread_mutex_unlock(lock)
+#define spin_trylock_bh(lock) (pthread_mutex_trylock(lock) == 0)
+#define DEFINE_MUTEX(name) pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+#define mutex_lock(lock) pthread_mutex_lock(lock)
+#define mutex_unlock(lock) pthread_mutex_unlock(lock)
 #endif
 
 #ifndef __KERNEL__
-typedef int atomic_t;
-int atomic_read(atomic_t* val) {return *val;}
-void atomic_set(atomic_t* val, int set_val) {*val = set_val;}
-int atomic_inc(atomic_t* val) {return *val += 1;}
-int atomic_dec(atomic_t* val) {return *val -= 1;}
-int atomic_dec_and_test(atomic_t* val) {*val -= 1; return val==0;}
+/* userspace lock-less list, any thread adds, one consumer at a time deletes */
+struct llist_node {
+	struct llist_node *next;
+};
+struct llist_head {
+	struct llist_node *_Atomic first;
+};
+#define init_llist_head(head) atomic_init(&(head)->first, NULL)
+#define llist_entry(ptr, type, member) container_of(ptr, type, member)
+int llist_add(struct llist_node *new, struct llist_head *head)
+{
+	struct llist_node *first = atomic_load_explicit(&head->first, memory_order_relaxed);
+
+	do {
+		new->next = first;
+	} while(!atomic_compare_exchange_weak_explicit(&head->first, &first, new,
+		memory_order_release, memory_order_relaxed));
+	return first == NULL;
+}
+struct llist_node *llist_del_first(struct llist_head *head)
+{
+	struct llist_node *entry = atomic_load_explicit(&head->first, memory_order_acquire);
+
+	do {
+		if(!entry)
+			return NULL;
+	} while(!atomic_compare_exchange_weak_explicit(&head->first, &entry, entry->next,
+		memory_order_acquire, memory_order_acquire));
+	return entry;
+}
+#endif
+
+#ifndef __KERNEL__
+typedef atomic_int atomic_t;
+int atomic_read(atomic_t* val) {return atomic_load(val);}
+void atomic_set(atomic_t* val, int set_val) {atomic_store(val, set_val);}
+int atomic_inc(atomic_t* val) {return atomic_fetch_add(val, 1) + 1;}
+int atomic_inc_return(atomic_t* val) {return atomic_fetch_add(val, 1) + 1;}
+int atomic_dec(atomic_t* val) {return atomic_fetch_sub(val, 1) - 1;}
+int atomic_dec_and_test(atomic_t* val) {return atomic_fetch_sub(val, 1) == 1;}
 int atomic_add_unless(atomic_t *val, int inc, int val_cmp)
 {
-	if(*val != val_cmp)
-	{
-		*val += inc;
-		return 1;
+	int old = atomic_load(val);
+
+	do {
+		if(old == val_cmp)
+			return 0;
+	} while(!atomic_compare_exchange_weak(val, &old, old + inc));
+	return 1;
+}
+#define atomic_inc_not_zero(v) atomic_add_unless((v), 1, 0)
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val) __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+#define smp_mb() atomic_thread_fence(memory_order_seq_cst)
+#define smp_mb__after_atomic() smp_mb()
+#define smp_rmb() atomic_thread_fence(memory_order_acquire)
+#define smp_wmb() atomic_thread_fence(memory_order_release)
+#endif
+
+#ifndef __KERNEL__
+/*
+ * userspace rcu: readers read lock rcu lock of their slot, grace period
+ * write locks all slots, so call_rcu frees after readers of the old pointer
+ */
+#define __rcu
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *head);
+};
+/*
+ * read sections nest, only the outer one locks the slot. callbacks queued
+ * inside a read section run after the outer unlock
+ */
+static __thread int ac_rcu_nesting;
+static __thread struct rcu_head *ac_rcu_deferred;
+void rcu_read_lock(void)
+{
+	if(!ac_rcu_nesting++)
+		pthread_rwlock_rdlock(&ac_slots[smp_processor_id()].rcu);
+}
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_read_unlock(void)
+{
+	struct rcu_head *head;
+
+	if(--ac_rcu_nesting)
+		return;
+	pthread_rwlock_unlock(&ac_slots[smp_processor_id()].rcu);
+	while((head = ac_rcu_deferred)) {
+		ac_rcu_deferred = head->next;
+		call_rcu(head, head->func);
 	}
+}
+/* waiting for own read section would never end */
+void synchronize_rcu(void)
+{
+	int i;
+
+	if(ac_rcu_nesting) {
+		AC_ERROR("synchronize_rcu: called in rcu read section\n");
+		abort();
+	}
+	for(i = 0; i < nr_cpu_ids; i++) {
+		pthread_rwlock_wrlock(&ac_slots[i].rcu);
+		pthread_rwlock_unlock(&ac_slots[i].rcu);
+	}
+}
+void rcu_barrier(void) {}
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_dereference_protected(p, c) (p)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define RCU_INIT_POINTER(p, v) ((p) = (v))
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+	if(ac_rcu_nesting) {
+		head->func = func;
+		head->next = ac_rcu_deferred;
+		ac_rcu_deferred = head;
+		return;
+	}
+	synchronize_rcu();
+	func(head);
+}
+#endif
+
+#ifndef __KERNEL__
+/*
+ * userspace percpu_ref: get and put add to the slot counter while the ref
+ * is live. kill marks it dead, waits for readers of the flag and folds the
+ * slot counters into count, which gets and puts use from then on.
+ * count keeps PERCPU_REF_BIAS while live, so it can't drop to zero early.
+ * kill waits for a grace period, it must not be called under rcu_read_lock
+ */
+#define GFP_KERNEL 0
+#define PERCPU_REF_BIAS (1L << 30)
+struct percpu_ref;
+typedef void (percpu_ref_func_t)(struct percpu_ref *ref);
+struct percpu_ref_slot {
+	long count;
+} ____cacheline_aligned_in_smp;
+struct percpu_ref {
+	struct percpu_ref_slot __percpu *slots;
+	atomic_long count;
+	int dead;
+	percpu_ref_func_t *release;
+};
+int percpu_ref_init(struct percpu_ref *ref, percpu_ref_func_t *release, unsigned flags, int gfp)
+{
+	ref->slots = alloc_percpu(struct percpu_ref_slot);
+	if(!ref->slots)
+		return -ENOMEM;
+	atomic_init(&ref->count, PERCPU_REF_BIAS + 1);
+	ref->dead = 0;
+	ref->release = release;
 	return 0;
 }
+void percpu_ref_exit(struct percpu_ref *ref)
+{
+	free_percpu(ref->slots);
+	ref->slots = NULL;
+}
+int percpu_ref_tryget_live(struct percpu_ref *ref)
+{
+	int ret = 0;
+
+	rcu_read_lock();
+	if(!__atomic_load_n(&ref->dead, __ATOMIC_RELAXED)) {
+		__ac_slot_add(&this_cpu_ptr(ref->slots)->count, 1);
+		ret = 1;
+	}
+	rcu_read_unlock();
+	return ret;
+}
+void percpu_ref_put(struct percpu_ref *ref)
+{
+	int last = 0;
+
+	rcu_read_lock();
+	if(!__atomic_load_n(&ref->dead, __ATOMIC_RELAXED))
+		__ac_slot_add(&this_cpu_ptr(ref->slots)->count, -1);
+	else
+		last = atomic_fetch_sub(&ref->count, 1) == 1;
+	rcu_read_unlock();
+	if(last)
+		ref->release(ref);
+}
+/* drop the initial reference, tryget_live fails from now on */
+void percpu_ref_kill(struct percpu_ref *ref)
+{
+	long sum = 0;
+	int cpu;
+
+	__atomic_store_n(&ref->dead, 1, __ATOMIC_RELAXED);
+	synchronize_rcu();
+	for_each_possible_cpu(cpu)
+		sum += __atomic_load_n(&per_cpu_ptr(ref->slots, cpu)->count, __ATOMIC_RELAXED);
+	sum -= PERCPU_REF_BIAS + 1;
+	if(atomic_fetch_add(&ref->count, sum) + sum == 0)
+		ref->release(ref);
+}
+#endif
+
+#ifndef __KERNEL__
+/*
+ * userspace ordered workqueue: with AC_THREADS_REBUILD work runs in the
+ * queue thread, otherwise queue_work runs it in the caller
+ */
+struct work_struct {
+	struct work_struct *next;
+	int pending;
+	void (*func)(struct work_struct *work);
+};
+#define INIT_WORK(work, fn) ((work)->next = NULL, (work)->pending = 0, (work)->func = (fn))
+struct workqueue_struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* work queued, finished or stop */
+	struct work_struct *first;
+	struct work_struct **last;
+	int running;
+	int stop;
+	int threaded;
+};
+static unsigned ac_threads_flags;
+
+static void *__ac_worker(void *arg)
+{
+	struct workqueue_struct *wq = arg;
+	struct work_struct *work;
+
+	pthread_mutex_lock(&wq->lock);
+	for(;;) {
+		while(!wq->first && !wq->stop)
+			pthread_cond_wait(&wq->cond, &wq->lock);
+		/* pending work is drained before stop */
+		work = wq->first;
+		if(!work)
+			break;
+		wq->first = work->next;
+		if(!wq->first)
+			wq->last = &wq->first;
+		work->pending = 0;
+		wq->running = 1;
+		pthread_mutex_unlock(&wq->lock);
+		work->func(work);
+		pthread_mutex_lock(&wq->lock);
+		wq->running = 0;
+		pthread_cond_broadcast(&wq->cond);
+	}
+	pthread_mutex_unlock(&wq->lock);
+	return NULL;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *name, unsigned flags, int max_active)
+{
+	struct workqueue_struct *wq = ac_zmalloc(sizeof(*wq));
+
+	if(!wq)
+		return NULL;
+	pthread_mutex_init(&wq->lock, NULL);
+	pthread_cond_init(&wq->cond, NULL);
+	wq->last = &wq->first;
+	if(ac_threads_flags & AC_THREADS_REBUILD) {
+		if(pthread_create(&wq->thread, NULL, __ac_worker, wq)) {
+			ac_free(wq);
+			return NULL;
+		}
+		wq->threaded = 1;
+	}
+	return wq;
+}
+
+int queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+	if(!wq->threaded) {
+		work->func(work);
+		return 1;
+	}
+	pthread_mutex_lock(&wq->lock);
+	if(work->pending) {
+		pthread_mutex_unlock(&wq->lock);
+		return 0;
+	}
+	work->pending = 1;
+	work->next = NULL;
+	*wq->last = work;
+	wq->last = &work->next;
+	pthread_cond_broadcast(&wq->cond);
+	pthread_mutex_unlock(&wq->lock);
+	return 1;
+}
+
+void flush_workqueue(struct workqueue_struct *wq)
+{
+	pthread_mutex_lock(&wq->lock);
+	while(wq->first || wq->running)
+		pthread_cond_wait(&wq->cond, &wq->lock);
+	pthread_mutex_unlock(&wq->lock);
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+	if(wq->threaded) {
+		pthread_mutex_lock(&wq->lock);
+		wq->stop = 1;
+		pthread_cond_broadcast(&wq->cond);
+		pthread_mutex_unlock(&wq->lock);
+		pthread_join(wq->thread, NULL);
+	}
+	pthread_cond_destroy(&wq->cond);
+	pthread_mutex_destroy(&wq->lock);
+	ac_free(wq);
+}
 #endif
 
 #ifndef atomic_inc_zero
 #define atomic_inc_zero(v)          atomic_add_unless((v), 1, 1)
 #endif
 
+/* domains list, domains are created and removed in process context */
+static DEFINE_MUTEX(domains_lock);
+
 #ifdef __KERNEL__
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Aho-Corasick framework kernel module with multifast-v1.4.2 core");
 MODULE_AUTHOR("Ilya Gavrilov <gilyav@gmail.com>");
 
-static DEFINE_SPINLOCK(domains_lock);
+/* dynamic cpu hotplug state, allocates automatas of cpus coming online */
+static enum cpuhp_state ac_cpuhp_state;
+
+static unsigned ac_reserve = 1024;
+module_param(ac_reserve, uint, 0444);
+MODULE_PARM_DESC(ac_reserve, "ac_pattern entries and short pattern strings reserved for ac_add_patterns under memory pressure");
+static struct kmem_cache *ac_pattern_cache;
+static mempool_t *ac_pattern_reserve;
+/* pattern strings up to this size with terminating zero come from reserve */
+#define AC_PATTERN_STR_SIZE 64
+static struct kmem_cache *ac_pattern_str_cache;
+static mempool_t *ac_pattern_str_reserve;
+#endif
+
+/* slab caches of fixed size objects, NULL in userspace */
+struct kmem_cache;
+static struct kmem_cache *ac_automata_cache;
+static struct kmem_cache *ac_shared_cache;
+
+/* generations of built and loaded automatas of all domains */
+static atomic_t ac_generation;
+
+#ifndef BITS_PER_LONG
+#define BITS_PER_LONG (8 * sizeof(long))
+#endif
+#ifndef BITS_TO_LONGS
+#define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#endif
+#ifdef __KERNEL__
+#define __ac_ffs(word) __ffs(word)
+#else
+#define __ac_ffs(word) __builtin_ctzl(word)
 #endif
-#define AC_PATTERNS_HSIZE 200 /* TODO: use as param */
 
 struct pattern {
     int num;
 	int use_count;
-#ifdef __KERNEL__
 	spinlock_t lock;
-#endif
 	char *pattern;
+	unsigned long tags; /* tags of bundles with pattern */
+	unsigned hash; /* __ac_pattern_hash of pattern */
+	struct hlist_node hash_list; /* in domain patterns_hash while pattern is set */
+	struct list_head free_list; /* in domain free_patterns while use_count is 0 */
 };
 
-struct ac_match {
-    struct list_head list;
-    int num;
+struct domain;
+
+/* finalized automata shared by all cursors of domain, read-only after build */
+struct shared_automata {
+	AC_AUTOMATA_t *atm;
+	struct percpu_ref refs; /* domain reference + one per lease, see __ac_shared_get */
+	struct rcu_head rcu;
+	unsigned tags_seq[BITS_PER_LONG]; /* domain tags_seq of masks build */
+	unsigned generation; /* ac_stream.generation of states of the automata */
+	struct domain *domain; /* memory is accounted to, NULL until it is set */
+	void *image; /* table image of loaded automata */
+	unsigned long image_size;
+	uint8_t mapped; /* image is mmaped file */
 };
 
-struct domain;
+/* stored match, offsets are from the start of automata lease */
+struct match {
+	int num; /* matched pattern number */
+	unsigned length; /* pattern length, start is end - length */
+	unsigned long end; /* offset after the match end */
+};
 
+/* search cursor leased by ac_get_automata */
 struct automata {
-	struct list_head list;
+	struct list_head list; /* in domain automatas_list */
+	struct llist_node free_node; /* in free stack of owner cpu while not leased */
 
 	struct domain *domain;
 	int id;
-	AC_AUTOMATA_t *atm;
-	uint8_t ignorecase; /* ascii only*/
-	uint8_t dirty; /* need rebuild */
-	uint8_t freed; /* freed atms should be moved from leased list to free list by thier owner cpu only */
-	atomic_t use;
-#ifdef __KERNEL__
-	struct work_struct work;
-#endif
-    struct list_head match;
+	int cpu; /* owner cpu, put returns automata to its free stack */
+	struct shared_automata *shared; /* automata used for the current lease */
+	AC_CURSOR_t cursor;
+	unsigned match_num; /* matches in match[] */
+	unsigned match_overflow; /* matches dropped since match[] is full */
+	struct match match[AC_MATCH_BUFFER_SIZE]; /* stored matches */
+	/* AC_DOMAIN_MATCH_BITSET: matched patterns, words lo..hi-1 are used */
+	unsigned long *match_bits;
+	unsigned match_bits_lo;
+	unsigned match_bits_hi;
+};
+
+/* domain memory categories */
+enum {
+	AC_MEM_NODES, /* trie nodes */
+	AC_MEM_EDGES, /* trie edges and pattern lists */
+	AC_MEM_TABLE, /* compiled table */
+	AC_MEM_PATTERNS, /* pattern slots, strings and bundle entries */
+	AC_MEM_MATCHES, /* automatas with their match buffers */
+	AC_MEM_MAX
 };
 
+/* domain memory of cpu in bytes, may be negative as freed on other cpu */
+struct ac_mem_stat {
+	long bytes[AC_MEM_MAX];
+};
+
+/*
+ * free automatas of cpu. any cpu pushes put automata, only the owner cpu
+ * pops with bh disabled, so llist_del_first has one consumer at a time
+ */
 struct automatas_pool
 {
-	struct list_head free;
-	struct list_head leased;
-	uint8_t rebuilding;
-};
+	struct llist_head free;
+	unsigned populated; /* automatas allocated for the cpu */
+	atomic_t leased; /* leased automatas of the pool, put decrements it from any cpu */
+} ____cacheline_aligned_in_smp;
 
 struct domain {
 	struct list_head list;
-#ifdef __KERNEL__
 	spinlock_t lock;
-#endif
 	int id;
 	char name[80];
+	unsigned flags; /* AC_DOMAIN_* */
 	struct pattern *patterns;
 	unsigned patterns_number;
-	struct automatas_pool *automatas;
-	unsigned automatas_number;
-#ifdef __KERNEL__
+	struct hlist_head *patterns_hash; /* patterns by string */
+	unsigned patterns_hsize; /* power of 2 */
+	struct list_head free_patterns; /* empty slots first, then unused patterns */
+	uint8_t image; /* automata is loaded image and was not rebuilt */
+	unsigned long tags; /* tags of bundles, see ac_patterns_tag */
+	unsigned tags_seq[BITS_PER_LONG]; /* changes of tagged bundles */
+	struct automatas_pool __percpu *automatas;
+	unsigned automatas_number; /* per cpu */
+	struct list_head automatas_list; /* all automatas of domain */
+	atomic_t shared_leased; /* references without automata, see __ac_shared_lease */
+	uint8_t dying; /* ac_remove_domain runs, new leases fail, see __ac_domain_dying */
+	struct ac_mem_stat __percpu *mem; /* see __ac_mem_account */
+	struct shared_automata __rcu *shared; /* current automata, written by rebuild_work only */
 	struct workqueue_struct *wq;
+	struct work_struct rebuild_work;
+#ifdef __KERNEL__
+	struct hlist_node cpuhp_node; /* instance of ac_cpuhp_state */
 #endif
 };
 
 LIST_HEAD(domains);
 static int domain_id = 0;
 
-void ac_free_automatas(void * domain_id);
 int __ac_clean_patterns(void * domain_id);
+static void __ac_free_domain(struct domain *dom);
+static void __ac_shared_account(struct shared_automata *shared, long sign);
+static void *__ac_cache_zalloc(struct kmem_cache *cache, size_t size);
+static void __ac_cache_free(struct kmem_cache *cache, void *ptr);
+static ac_pattern *__ac_pattern_alloc(void);
+static void __ac_pattern_free(ac_pattern *entry);
+static char *__ac_pattern_str_alloc(size_t size);
+static void __ac_pattern_str_free(char *str);
+static void __ac_domain_rebuild_work(struct work_struct *work);
+struct shared_automata *__ac_shared_build(struct domain *dom);
+struct shared_automata *__ac_shared_get(struct domain *dom);
+void __ac_shared_put(struct shared_automata *shared);
+static void __ac_shared_kill(struct shared_automata *shared);
+static void __ac_shared_release(struct percpu_ref *ref);
+static struct shared_automata *__ac_shared_lease(struct domain *dom);
+static void __ac_shared_unlease(struct domain *dom, struct shared_automata *shared);
+int __ac_domain_rebuild(struct domain *dom);
+static void __ac_hash_pattern(struct domain *dom, struct pattern *patt);
+static void __ac_clear_match_bits(struct automata *atm);
+static void __ac_tag_changed(struct domain *dom, unsigned long tag);
+static unsigned long __ac_pattern_tags(AC_PATTERN_t *pattern, void *param);
+void __ac_set_bit(unsigned long *mask, int n);
+int __ac_test_bit(unsigned long *mask, int n);
+inline void __ac_clear_bit(unsigned long *mask, int n); 
+
+/* update domain memory of category, bytes are summed by ac_meminfo */
 #ifdef __KERNEL__
-static void __ac_automata_rebuild( struct work_struct *work);
+#define __ac_mem_account(dom, cat, size) this_cpu_add((dom)->mem->bytes[cat], (size))
 #else
-void __ac_automata_rebuild(struct automata *atm);
+#define __ac_mem_account(dom, cat, size) __ac_slot_add(&this_cpu_ptr((dom)->mem)->bytes[cat], (size))
 #endif
-int __ac_automatas_rebuild(struct list_head *automatas, struct pattern *patterns, unsigned patt_num, int cpu);
-int __ac_domain_rebuild(struct domain *dom);
-void __ac_set_bit(uint8_t *mask, int n);
-int __ac_test_bit(uint8_t *mask, int n);
-inline void __ac_clear_bit(uint8_t *mask, int n); 
 
-void *ac_add_domain(const char* domain, unsigned automatas_number, unsigned patterns_number, int ignorecase)
+/*
+ * allocate automatas of cpu up to automatas_number. it runs for online cpus
+ * at domain creation and from cpu hotplug, both under cpu hotplug lock
+ */
+static int __ac_populate_cpu(struct domain *dom, unsigned cpu)
 {
-	int i, j;
-	struct domain *dom;
+	struct automatas_pool *pool = per_cpu_ptr(dom->automatas, cpu);
 	struct automata *atm;
 
-	list_for_each_entry(dom, &domains, list) {
-		if(strcmp(dom->name, domain) == 0 ) {
-			AC_ERROR("Domain %s already exists\n", domain);
-			return NULL;
+	for(; pool->populated < dom->automatas_number; pool->populated++) {
+		atm = __ac_cache_zalloc(ac_automata_cache, sizeof(*atm));
+		if(!atm)
+			return -ENOMEM;
+		if(dom->flags & AC_DOMAIN_MATCH_BITSET) {
+			atm->match_bits = ac_zmalloc(BITS_TO_LONGS(dom->patterns_number)*sizeof(long));
+			if(!atm->match_bits) {
+				__ac_cache_free(ac_automata_cache, atm);
+				return -ENOMEM;
+			}
 		}
+		__ac_mem_account(dom, AC_MEM_MATCHES, sizeof(*atm) +
+			(atm->match_bits ? BITS_TO_LONGS(dom->patterns_number)*sizeof(long) : 0));
+		atm->id = pool->populated;
+		atm->cpu = cpu;
+		atm->domain = dom;
+		list_add_tail(&atm->list, &dom->automatas_list);
+		llist_add(&atm->free_node, &pool->free);
 	}
+	return 0;
+}
+
+#ifdef __KERNEL__
+static int __ac_cpu_online(unsigned int cpu, struct hlist_node *node)
+{
+	struct domain *dom = hlist_entry(node, struct domain, cpuhp_node);
+
+	/* don't fail cpu online, leases on the cpu fail until it is populated */
+	if(__ac_populate_cpu(dom, cpu))
+		AC_ERROR("Error allocating automatas of cpu %u for %s\n", cpu, dom->name);
+	return 0;
+}
+#endif
+
+/* create domain, with empty automata or with given one (always consumed) */
+static struct domain *__ac_add_domain(const char* domain, unsigned automatas_number, unsigned patterns_number, unsigned flags, struct shared_automata *shared)
+{
+	int i;
+	unsigned cpu;
+	struct domain *dom;
+	struct domain *d;
+
 	dom = (struct domain*)ac_zmalloc(sizeof(struct domain));
 	if(!dom)
 	{
 		AC_ERROR("Error allocating domain %s\n", domain);
+		if(shared)
+			__ac_shared_kill(shared);
 		return NULL;
 	}
+	dom->mem = alloc_percpu(struct ac_mem_stat);
+	if(!dom->mem) {
+		AC_ERROR("Error allocating domain %s\n", domain);
+		ac_free(dom);
+		if(shared)
+			__ac_shared_kill(shared);
+		return NULL;
+	}
+	RCU_INIT_POINTER(dom->shared, shared);
+	if(shared) {
+		shared->domain = dom;
+		__ac_shared_account(shared, 1);
+	}
+	INIT_LIST_HEAD(&dom->list);
+	INIT_LIST_HEAD(&dom->automatas_list);
 	strncpy(dom->name, domain, 80);
-	dom->id = domain_id++;
-	dom->patterns = ac_zmalloc(sizeof(struct pattern)*patterns_number);
-	if(!dom->patterns) {
-		ac_remove_domain(dom);
+	dom->flags = flags;
+	/* loaded automata has zero tags_seq: its masks are never used */
+	for(i = 0; i < BITS_PER_LONG; i++)
+		dom->tags_seq[i] = 1;
+	for(dom->patterns_hsize = 16; dom->patterns_hsize < patterns_number; dom->patterns_hsize <<= 1);
+	dom->patterns = ac_vmalloc(sizeof(struct pattern)*patterns_number);
+	dom->patterns_hash = ac_vmalloc(sizeof(struct hlist_head)*dom->patterns_hsize);
+	if(!dom->patterns || !dom->patterns_hash) {
+		__ac_free_domain(dom);
 		AC_ERROR("Error allocating domain paterns for %s\n", domain);
 		return NULL;
 	}
+	memset(dom->patterns, 0, sizeof(struct pattern)*patterns_number);
+	__ac_mem_account(dom, AC_MEM_PATTERNS, sizeof(struct pattern)*patterns_number +
+		sizeof(struct hlist_head)*dom->patterns_hsize);
 	dom->patterns_number = patterns_number;
 	dom->automatas_number = automatas_number;
+	INIT_LIST_HEAD(&dom->free_patterns);
 	for(i = 0; i < dom->patterns_number; i++) {
-#ifdef __KERNEL__
 		spin_lock_init(&dom->patterns[i].lock);
-#endif
         dom->patterns[i].num = i;
+		INIT_HLIST_NODE(&dom->patterns[i].hash_list);
+		list_add_tail(&dom->patterns[i].free_list, &dom->free_patterns);
     }
-	dom->automatas = (struct automatas_pool*) ac_zmalloc(nr_cpu_ids*sizeof(struct automatas_pool));
+	for(i = 0; i < dom->patterns_hsize; i++)
+		INIT_HLIST_HEAD(&dom->patterns_hash[i]);
+	dom->automatas = alloc_percpu(struct automatas_pool);
 	if(!dom->automatas) {
-		ac_remove_domain(dom);
+		__ac_free_domain(dom);
 		AC_ERROR("Error allocating domain queues for %s\n", domain);
 		return NULL;
 	}
-	for(i = 0; i < nr_cpu_ids ; i++ ) {
-		INIT_LIST_HEAD(&dom->automatas[i].free);
-		INIT_LIST_HEAD(&dom->automatas[i].leased);
-	}
-#ifdef __KERNEL__
 	dom->wq = alloc_workqueue(dom->name, 0, 1);
 	if(!dom->wq)
 	{
-		ac_remove_domain(dom);
+		__ac_free_domain(dom);
 		AC_ERROR("Error allocating workqueues for %s\n", domain);
 		return NULL;
 	}
 	spin_lock_init(&dom->lock);
-#endif
-	for(i = 0; i < nr_cpu_ids ; i++ )
-		for(j = 0; j < automatas_number; j++) {
-			atm = ac_zmalloc(sizeof(*atm));
-			if(!atm) {
-				ac_remove_domain(dom);
-				return NULL;
-			}
-			atm->id = j;
-			atm->domain = dom;
-			atm->ignorecase = ignorecase;
-			atm->atm = ac_automata_init(atm->ignorecase);
-			ac_automata_finalize(atm->atm);
-			list_add_tail(&atm->list, &dom->automatas[i].free);
-#ifdef __KERNEL__
-			INIT_WORK( &atm->work, __ac_automata_rebuild );
-#endif
-            INIT_LIST_HEAD( &atm->match );
+	INIT_WORK(&dom->rebuild_work, __ac_domain_rebuild_work);
+	if(!shared) {
+		shared = __ac_shared_build(dom);
+		if(!shared) {
+			__ac_free_domain(dom);
+			return NULL;
 		}
+		RCU_INIT_POINTER(dom->shared, shared);
+	}
 
+	/* cpus coming online later are populated by __ac_cpu_online */
+	i = 0;
+	cpus_read_lock();
+	for_each_online_cpu(cpu) {
+		i = __ac_populate_cpu(dom, cpu);
+		if(i)
+			break;
+	}
 #ifdef __KERNEL__
-	spin_lock(&domains_lock);
+	if(!i)
+		i = cpuhp_state_add_instance_nocalls_cpuslocked(ac_cpuhp_state, &dom->cpuhp_node);
 #endif
+	cpus_read_unlock();
+	if(i) {
+		AC_ERROR("Error allocating automatas for %s\n", domain);
+		__ac_free_domain(dom);
+		return NULL;
+	}
+
+	mutex_lock(&domains_lock);
+	list_for_each_entry(d, &domains, list) {
+		if(strcmp(d->name, dom->name) == 0 ) {
+			mutex_unlock(&domains_lock);
+			AC_ERROR("Domain %s already exists\n", domain);
+			__ac_free_domain(dom);
+			return NULL;
+		}
+	}
+	dom->id = domain_id++;
 	list_add_tail(&dom->list, &domains);
-#ifdef __KERNEL__
-	spin_unlock(&domains_lock);
-#endif
+	mutex_unlock(&domains_lock);
 
 	return dom;
 }
+
+void *ac_add_domain(const char* domain, unsigned automatas_number, unsigned patterns_number, unsigned flags)
+{
+	return __ac_add_domain(domain, automatas_number, patterns_number, flags, NULL);
+}
 EXPORT_SYMBOL_GPL(ac_add_domain);
 
-int ac_remove_domain(void * domain_id)
+long ac_save_domain(void * domain_id, void *image, unsigned long size)
 {
 	struct domain *dom = (struct domain *)domain_id;
-	struct automata *atm;
-	struct automata *atm_safe;
-	int i;
+	struct shared_automata *shared;
+	AC_TABLE_t *table;
+	long ret;
+
+	shared = __ac_shared_lease(dom);
+	if(!shared)
+		return -EINVAL;
+	table = shared->atm->table;
+	if(!table)
+		ret = -EINVAL; /* not compiled */
+	else if(!image)
+		ret = table->size;
+	else if(!ac_table_save(table, image, size))
+		ret = -ENOSPC;
+	else
+		ret = table->size;
+	__ac_shared_unlease(dom, shared);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ac_save_domain);
 
-	AC_DEBUG("ac_remove_domain: remove domain %s(%p)\n", dom->name, dom);
-	ac_free_automatas(domain_id);
+/* wrap table image into automata, the image is owned by automata on success */
+static struct shared_automata *__ac_shared_load(void *image, unsigned long size, uint8_t mapped)
+{
+	struct shared_automata *shared;
 
-	/* automatas_leased must be empty here */
-	for(i = 0; i < nr_cpu_ids ; i++ )
-		if(!list_empty(&dom->automatas[i].leased)) {
-			AC_ERROR("Domain %s is busy\n", dom->name);
-			return -1;
+	shared = __ac_cache_zalloc(ac_shared_cache, sizeof(*shared));
+	if(!shared)
+		return NULL;
+	shared->atm = ac_automata_load(image, size);
+	if(!shared->atm) {
+		AC_ERROR("__ac_shared_load: invalid automata image\n");
+		__ac_cache_free(ac_shared_cache, shared);
+		return NULL;
+	}
+	shared->image = image;
+	shared->image_size = size;
+	shared->mapped = mapped;
+	shared->generation = atomic_inc_return(&ac_generation);
+	if(percpu_ref_init(&shared->refs, __ac_shared_release, 0, GFP_KERNEL)) {
+		ac_automata_release(shared->atm);
+		__ac_cache_free(ac_shared_cache, shared);
+		return NULL;
+	}
+	return shared;
+}
+
+/* domain patterns are restored from the image with zero use count */
+static struct domain *__ac_load_domain(const char *domain, struct shared_automata *shared, unsigned automatas_number, unsigned patterns_number)
+{
+	struct domain *dom;
+	AC_TABLE_t *table = shared->atm->table;
+	AC_PATTERN_t *patterns = AC_TABLE_PATTERNS(table);
+	const char *str = AC_TABLE_STRINGS(table);
+	struct pattern *patt;
+	unsigned flags = AC_DOMAIN_COMPILED;
+	unsigned i;
+
+	for(i = 0; i < table->patterns_num; i++)
+		if(patterns[i].rep.number < 0 || patterns[i].rep.number >= patterns_number) {
+			AC_ERROR("ac_load_domain: pattern %ld out of domain %s patterns\n", patterns[i].rep.number, domain);
+			__ac_shared_kill(shared);
+			return NULL;
 		}
+	if(table->flags & AC_TABLE_IGNORECASE)
+		flags |= AC_DOMAIN_IGNORECASE;
+	dom = __ac_add_domain(domain, automatas_number, patterns_number, flags, shared);
+	if(!dom)
+		return NULL;
 
-#ifdef __KERNEL__
-	if(!spin_trylock_bh(&dom->lock))
-		return -EBUSY;
-	spin_lock(&domains_lock);
+	for(i = 0; i < table->patterns_num; i++) {
+		patt = &dom->patterns[patterns[i].rep.number];
+		if(patt->pattern) {
+			AC_ERROR("ac_load_domain: duplicate pattern %d in domain %s\n", patt->num, domain);
+			ac_remove_domain(dom);
+			return NULL;
+		}
+		patt->pattern = __ac_pattern_str_alloc(patterns[i].length + 1);
+		if(!patt->pattern) {
+			ac_remove_domain(dom);
+			return NULL;
+		}
+		memcpy(patt->pattern, str, patterns[i].length + 1);
+		__ac_mem_account(dom, AC_MEM_PATTERNS, patterns[i].length + 1);
+		str += patterns[i].length + 1;
+		__ac_hash_pattern(dom, patt);
+		/* keep empty slots first in free list */
+		list_move_tail(&patt->free_list, &dom->free_patterns);
+	}
+	dom->image = 1;
+	return dom;
+}
+
+void *ac_load_domain(const char *domain, const void *image, unsigned long size, unsigned automatas_number, unsigned patterns_number)
+{
+	struct shared_automata *shared;
+	void *copy;
+
+	copy = ac_vmalloc(size);
+	if(!copy)
+		return NULL;
+	memcpy(copy, image, size);
+	shared = __ac_shared_load(copy, size, 0);
+	if(!shared) {
+		ac_vfree(copy);
+		return NULL;
+	}
+	return __ac_load_domain(domain, shared, automatas_number, patterns_number);
+}
+EXPORT_SYMBOL_GPL(ac_load_domain);
+
+#ifndef __KERNEL__
+int ac_save_domain_file(void * domain_id, const char *path)
+{
+	long size;
+	void *image;
+	FILE *f;
+	int ret = 0;
+
+	size = ac_save_domain(domain_id, NULL, 0);
+	if(size < 0)
+		return size;
+	image = ac_vmalloc(size);
+	if(!image)
+		return -ENOMEM;
+	size = ac_save_domain(domain_id, image, size);
+	if(size < 0) {
+		ac_vfree(image);
+		return size;
+	}
+	f = fopen(path, "wb");
+	if(!f || fwrite(image, 1, size, f) != size)
+		ret = -EIO;
+	if(f && fclose(f))
+		ret = -EIO;
+	ac_vfree(image);
+	return ret;
+}
+
+void *ac_load_domain_file(const char *domain, const char *path, unsigned automatas_number, unsigned patterns_number)
+{
+	struct shared_automata *shared;
+	struct stat st;
+	void *image;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		AC_ERROR("ac_load_domain_file: can't open %s\n", path);
+		return NULL;
+	}
+	if(fstat(fd, &st) || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+	/* read only shared mapping: processes loading the image share page cache */
+	image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(image == MAP_FAILED)
+		return NULL;
+	shared = __ac_shared_load(image, st.st_size, 1);
+	if(!shared) {
+		munmap(image, st.st_size);
+		return NULL;
+	}
+	return __ac_load_domain(domain, shared, automatas_number, patterns_number);
+}
+
+int ac_init_threads(unsigned workers, unsigned flags)
+{
+	int ret = 0;
+
+	if(workers == 0 || workers > AC_THREADS_MAX)
+		return -EINVAL;
+	/* per cpu data of domains is sized by nr_cpu_ids */
+	mutex_lock(&domains_lock);
+	if(list_empty(&domains)) {
+		nr_cpu_ids = workers;
+		ac_threads_flags = flags;
+	} else
+		ret = -EBUSY;
+	mutex_unlock(&domains_lock);
+	return ret;
+}
 #endif
+
+/* leases are counted by pool of the automata, so get and put stay cpu local */
+static int __ac_domain_leased(struct domain *dom)
+{
+	unsigned cpu;
+
+	if(atomic_read(&dom->shared_leased))
+		return 1;
+	for_each_possible_cpu(cpu)
+		if(atomic_read(&per_cpu_ptr(dom->automatas, cpu)->leased))
+			return 1;
+	return 0;
+}
+
+/*
+ * leases count themselves before they check dying and ac_remove_domain sets
+ * dying before it checks the counts, so either the lease fails or the
+ * domain is busy. leases do it in rcu read section, ac_remove_domain waits
+ * for them before the domain is freed.
+ */
+static int __ac_domain_dying(struct domain *dom)
+{
+	smp_mb__after_atomic();
+	return READ_ONCE(dom->dying);
+}
+
+int ac_remove_domain(void * domain_id)
+{
+	struct domain *dom = (struct domain *)domain_id;
+
+	AC_DEBUG("ac_remove_domain: remove domain %s(%p)\n", dom->name, dom);
+
+	mutex_lock(&domains_lock);
+	if(!spin_trylock_bh(&dom->lock)) {
+		mutex_unlock(&domains_lock);
+		return -EBUSY;
+	}
+	WRITE_ONCE(dom->dying, 1);
+	smp_mb();
+	if(__ac_domain_leased(dom)) {
+		WRITE_ONCE(dom->dying, 0);
+		spin_unlock_bh(&dom->lock);
+		mutex_unlock(&domains_lock);
+		AC_ERROR("Domain %s is busy\n", dom->name);
+		return -1;
+	}
 	list_del(&dom->list);
-#ifdef __KERNEL__
-	spin_unlock(&domains_lock);
 	spin_unlock_bh(&dom->lock);
+	mutex_unlock(&domains_lock);
+	/* leases that missed dying give up in their rcu read section */
+	synchronize_rcu();
+	__ac_free_domain(dom);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ac_remove_domain);
+
+void ac_flush_domain(void * domain_id)
+{
+	struct domain *dom = (struct domain *)domain_id;
+
+	flush_workqueue(dom->wq);
+}
+EXPORT_SYMBOL_GPL(ac_flush_domain);
+
+/* release domain that is not in domains list */
+static void __ac_free_domain(struct domain *dom)
+{
+	struct automata *atm;
+	struct automata *atm_safe;
+	struct shared_automata *shared;
+
+#ifdef __KERNEL__
+	if(!hlist_unhashed(&dom->cpuhp_node))
+		cpuhp_state_remove_instance_nocalls(ac_cpuhp_state, &dom->cpuhp_node);
+#endif
 	if(dom->wq)
 		destroy_workqueue( dom->wq );
-#endif
-	for(i = 0; i < nr_cpu_ids ; i++ )
-		list_for_each_entry_safe(atm, atm_safe, &dom->automatas[i].free, list) {
-			list_del(&atm->list);
-			if(atm->atm)
-				ac_automata_release(atm->atm);
-			ac_free(atm);
-		}
+	list_for_each_entry_safe(atm, atm_safe, &dom->automatas_list, list) {
+		list_del(&atm->list);
+		if(atm->match_bits)
+			ac_free(atm->match_bits);
+		__ac_cache_free(ac_automata_cache, atm);
+	}
+
+	if(dom->automatas)
+		free_percpu(dom->automatas);
 
-	ac_free(dom->automatas);
+	/* workqueue is destroyed, nobody can publish new automata */
+	shared = rcu_dereference_protected(dom->shared, 1);
+	if(shared) {
+		RCU_INIT_POINTER(dom->shared, NULL);
+		__ac_shared_kill(shared);
+	}
+	/* automatas killed here and by rebuilds are released in rcu callbacks */
+	rcu_barrier();
 
 	if(dom->patterns) {
 	    __ac_clean_patterns(dom);
-		ac_free(dom->patterns);
+		ac_vfree(dom->patterns);
 	}
+	ac_vfree(dom->patterns_hash);
 
+	free_percpu(dom->mem);
 	ac_free(dom);
-	return 0;
 }
-EXPORT_SYMBOL_GPL(ac_remove_domain);
 
 int ac_patterns_init(ac_patterns *patt)
 {
     int i;
-    *patt = ac_malloc(sizeof(**patt) * AC_PATTERNS_HSIZE);
+    *patt = ac_malloc(sizeof(**patt));
     if(*patt == 0)
         return -ENOMEM;
 
     for(i = 0; i < AC_PATTERNS_HSIZE; i++)
-        INIT_HLIST_HEAD(*patt+i);
+        INIT_HLIST_HEAD((*patt)->hash+i);
+    (*patt)->bits = NULL;
+    (*patt)->tag = 0;
 
 	return 0;
 }
 EXPORT_SYMBOL_GPL(ac_patterns_init);
 
+/* invalidate automata masks of tag, called under domain lock */
+static void __ac_tag_changed(struct domain *dom, unsigned long tag)
+{
+	smp_wmb(); /* pattern tags before tags_seq */
+	dom->tags_seq[__ac_ffs(tag)]++;
+}
+
+/* FNV-1a */
+static unsigned __ac_pattern_hash(const char *pattern)
+{
+	unsigned hash = 2166136261u;
+
+	while(*pattern)
+		hash = (hash ^ (unsigned char)*pattern++) * 16777619u;
+	return hash;
+}
+
+static void __ac_hash_pattern(struct domain *dom, struct pattern *patt)
+{
+	patt->hash = __ac_pattern_hash(patt->pattern);
+	hlist_add_head(&patt->hash_list, &dom->patterns_hash[patt->hash & (dom->patterns_hsize - 1)]);
+}
+
+static struct pattern *__ac_find_pattern(struct domain *dom, const char *pattern)
+{
+	struct pattern *patt;
+	unsigned hash = __ac_pattern_hash(pattern);
+
+	hlist_for_each_entry(patt, &dom->patterns_hash[hash & (dom->patterns_hsize - 1)], hash_list)
+		if(patt->hash == hash && strcmp(patt->pattern, pattern) == 0)
+			return patt;
+	return NULL;
+}
+
 int ac_add_patterns(void * domain_id, const char *patts[], unsigned patterns_num, ac_patterns* patterns)
 {
 	struct domain *dom = (struct domain *)domain_id;
 	struct pattern *patt;
-	struct pattern *patt_free;
 	ac_pattern *entry;
 	const char *pattern;
 	char *pattern_str;
 	uint8_t need_rebuild = 0;
-	int i;
 	int j;
 	int ret = 0;
 
-#ifdef __KERNEL__
-	if(!spin_trylock_bh(&dom->lock))
-		return -EBUSY;
-#endif
+	spin_lock_bh(&dom->lock);
+	if((dom->flags & AC_DOMAIN_MATCH_BITSET) && !(*patterns)->bits) {
+		(*patterns)->bits = ac_zmalloc_atomic(BITS_TO_LONGS(dom->patterns_number)*sizeof(long));
+		if(!(*patterns)->bits) {
+			spin_unlock_bh(&dom->lock);
+			return -ENOMEM;
+		}
+		__ac_mem_account(dom, AC_MEM_PATTERNS, BITS_TO_LONGS(dom->patterns_number)*sizeof(long));
+	}
 	for(j=0; j<patterns_num; j++)
 	{
 		pattern = patts[j];
-		patt = NULL;
-		patt_free = NULL;
-		for(i = 0; i < dom->patterns_number; i++) {
-			patt = &dom->patterns[i];
-			if(!patt_free && patt->use_count == 0)
-				patt_free = patt;
-			if(patt->pattern && (strcmp(patt->pattern, pattern) == 0))
-				break;
-			patt = NULL;
+		entry = __ac_pattern_alloc();
+		if(!entry) {
+			ret = -ENOMEM;
+			break;
 		}
+		patt = __ac_find_pattern(dom, pattern);
 		if(!patt) {
-			if(!patt_free) {
+			if(list_empty(&dom->free_patterns)) {
+				__ac_pattern_free(entry);
 				ret = -ENOMEM;
 				break;
 			}
-			patt = patt_free;
-			pattern_str = ac_malloc_atomic(strlen(pattern)+1);
+			patt = list_first_entry(&dom->free_patterns, struct pattern, free_list);
+			pattern_str = __ac_pattern_str_alloc(strlen(pattern)+1);
 			if(!pattern_str) {
+				__ac_pattern_free(entry);
 				ret = -ENOMEM;
 				break;
 			}
+			if(patt->pattern)
+				hlist_del_init(&patt->hash_list);
 
-#ifdef __KERNEL__
 			spin_lock_bh(&patt->lock);
-#endif
-			if(patt->pattern)
-				ac_free(patt->pattern);
+			if(patt->pattern) {
+				__ac_mem_account(dom, AC_MEM_PATTERNS, -(long)(strlen(patt->pattern)+1));
+				__ac_pattern_str_free(patt->pattern);
+			}
 			patt->pattern = pattern_str;
 			strcpy(patt->pattern, pattern);
-#ifdef __KERNEL__
+			__ac_mem_account(dom, AC_MEM_PATTERNS, strlen(pattern)+1);
 			spin_unlock_bh(&patt->lock);
-#endif
+			__ac_hash_pattern(dom, patt);
 			need_rebuild = 1;
 		}
-		entry = ac_zmalloc_atomic(sizeof(*entry));
-		if(!entry) {
-			ret = -ENOMEM;
-			break;
+		else if(patt->use_count == 0 && !dom->image) {
+			/* unused pattern was dropped by rebuild after its removal */
+			need_rebuild = 1;
 		}
+		if(patt->use_count == 0)
+			list_del_init(&patt->free_list);
 		/* TODO: check whether need memory barrier here */
 		++patt->use_count;
 		entry->pattern = patt;
+		__ac_mem_account(dom, AC_MEM_PATTERNS, sizeof(*entry));
 
-		hlist_add_head(&entry->list, *patterns + patt->num % AC_PATTERNS_HSIZE);
+		hlist_add_head(&entry->list, (*patterns)->hash + patt->num % AC_PATTERNS_HSIZE);
+		patt->tags |= (*patterns)->tag;
+		if((*patterns)->bits)
+			__ac_set_bit((*patterns)->bits, patt->num);
+	}
+	if((*patterns)->tag && j) {
+		/* automata masks must be rebuilt for new patterns of the bundle */
+		__ac_tag_changed(dom, (*patterns)->tag);
+		need_rebuild = 1;
 	}
 	if(need_rebuild)
 		__ac_domain_rebuild(dom);
-#ifdef __KERNEL__
 	spin_unlock_bh(&dom->lock);
-#endif
 	return ret;
 }
 EXPORT_SYMBOL_GPL(ac_add_patterns);
 
+int ac_patterns_tag(void * domain_id, ac_patterns *patterns)
+{
+	struct domain *dom = (struct domain *)domain_id;
+	ac_pattern *entry;
+	unsigned long tag;
+	int i;
+
+	if((*patterns)->tag)
+		return 0;
+	spin_lock_bh(&dom->lock);
+	tag = ~dom->tags & (dom->tags + 1); /* lowest free */
+	if(tag) {
+		dom->tags |= tag;
+		(*patterns)->tag = tag;
+		for(i = 0; i < AC_PATTERNS_HSIZE; i++)
+			hlist_for_each_entry(entry, (*patterns)->hash+i, list)
+				((struct pattern*)entry->pattern)->tags |= tag;
+		__ac_tag_changed(dom, tag);
+		__ac_domain_rebuild(dom);
+	}
+	spin_unlock_bh(&dom->lock);
+	return tag ? 0 : -ENOSPC;
+}
+EXPORT_SYMBOL_GPL(ac_patterns_tag);
+
 int ac_remove_patterns(void * domain_id, ac_patterns *patterns)
 {
 	struct domain *dom = (struct domain *)domain_id;
@@ -378,147 +1264,609 @@ int ac_remove_patterns(void * domain_id, ac_patterns *patterns)
 	uint8_t need_rebuild = 0;
     int i;
 
-#ifdef __KERNEL__
-	if(!spin_trylock_bh(&dom->lock))
-		return -EBUSY;
-#endif
+	spin_lock_bh(&dom->lock);
     for(i = 0; i < AC_PATTERNS_HSIZE; i++) {
-        hlist_for_each_entry_safe(entry, n, *patterns+i, list) {
+        hlist_for_each_entry_safe(entry, n, (*patterns)->hash+i, list) {
             hlist_del(&entry->list);
             patt = entry->pattern;
-            ac_free(entry);
-            if(--patt->use_count == 0)
+            __ac_pattern_free(entry);
+            __ac_mem_account(dom, AC_MEM_PATTERNS, -(long)sizeof(*entry));
+            patt->tags &= ~(*patterns)->tag;
+            if(--patt->use_count == 0) {
+                list_add_tail(&patt->free_list, &dom->free_patterns);
                 need_rebuild = 1;
+            }
             AC_DEBUG("ac_remove_patterns: num: %d use_count: %d\n", patt->num, patt->use_count);
         }
     }
+	if((*patterns)->tag) {
+		dom->tags &= ~(*patterns)->tag;
+		__ac_tag_changed(dom, (*patterns)->tag);
+	}
+	if((*patterns)->bits)
+		__ac_mem_account(dom, AC_MEM_PATTERNS, -(long)(BITS_TO_LONGS(dom->patterns_number)*sizeof(long)));
 	if(need_rebuild)
 		__ac_domain_rebuild(dom);
-#ifdef __KERNEL__
 	spin_unlock_bh(&dom->lock);
+    if((*patterns)->bits)
+        ac_free((*patterns)->bits);
+    ac_free(*patterns);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ac_remove_patterns);
+
+void *ac_get_automata(void * domain_id)
+{
+	struct domain *dom = (struct domain *)domain_id;
+	struct automata *atm;
+	struct automatas_pool *pool;
+	struct llist_node *node;
+
+	rcu_read_lock();
+	local_bh_disable();
+	node = llist_del_first(&this_cpu_ptr(dom->automatas)->free);
+	local_bh_enable();
+	if(!node) {
+		rcu_read_unlock();
+		return NULL;
+	}
+	atm = llist_entry(node, struct automata, free_node);
+	AC_DEBUG("ac_get_automata: got atm: %p\n", atm);
+	pool = per_cpu_ptr(dom->automatas, atm->cpu);
+	atomic_inc(&pool->leased);
+	/* the lease searches with the automata current at this moment */
+	atm->shared = __ac_domain_dying(dom) ? NULL : __ac_shared_get(dom);
+	if(!atm->shared) {
+		llist_add(&atm->free_node, &pool->free);
+		atomic_dec(&pool->leased);
+		rcu_read_unlock();
+		return NULL;
+	}
+	rcu_read_unlock();
+	if(atm->match_bits)
+		__ac_clear_match_bits(atm);
+	atm->match_num = 0;
+	atm->match_overflow = 0;
+	ac_automata_cursor_reset(atm->shared->atm, &atm->cursor);
+	atm->cursor.mode = AC_MATCH_ALL;
+	return atm;
+}
+EXPORT_SYMBOL_GPL(ac_get_automata);
+
+void ac_put_automata(void * domain_id, void *automata)
+{
+	struct domain *dom = (struct domain *)domain_id;
+	struct automata *atm = (struct automata*)automata;
+	struct automatas_pool *pool;
+
+	AC_DEBUG("ac_put_automata: put atm: %p\n", atm);
+	__ac_shared_put(atm->shared);
+	atm->shared = NULL;
+	/* may run on other cpu, the owner pops it on next get */
+	pool = per_cpu_ptr(dom->automatas, atm->cpu);
+	llist_add(&atm->free_node, &pool->free);
+	atomic_dec(&pool->leased);
+}
+EXPORT_SYMBOL_GPL(ac_put_automata);
+
+int __ac_match_handler (AC_MATCH_t * matchp, void * param)
+{
+    unsigned int j;
+	unsigned num;
+	struct automata *atm = (struct automata*)param;
+    for (j=0; j < matchp->match_num; j++) {
+        AC_DEBUG ("\t__ac_match_handler %lu (%s)\n", matchp->patterns[j].rep.number, matchp->patterns[j].astring);
+		/* TODO: if pattern changed since search started - do not mark it here */
+		if(atm->match_bits) {
+			num = matchp->patterns[j].rep.number;
+			if(__ac_test_bit(atm->match_bits, num))
+				continue;
+			__ac_set_bit(atm->match_bits, num);
+			if(num / BITS_PER_LONG < atm->match_bits_lo)
+				atm->match_bits_lo = num / BITS_PER_LONG;
+			if(num / BITS_PER_LONG >= atm->match_bits_hi)
+				atm->match_bits_hi = num / BITS_PER_LONG + 1;
+		}
+		/* keep the first matches, count dropped ones and go on searching */
+		if(atm->match_num == AC_MATCH_BUFFER_SIZE) {
+			atm->match_overflow += matchp->match_num - j;
+			break;
+		}
+		atm->match[atm->match_num].num = matchp->patterns[j].rep.number;
+		atm->match[atm->match_num].length = matchp->patterns[j].length;
+		atm->match[atm->match_num].end = matchp->position;
+		atm->match_num++;
+	}
+
+    return 0;
+}
+
+int ac_search(void *automata, const void *data, unsigned len)
+{
+    AC_TEXT_t input_text;
+	struct automata *atm = (struct automata*)automata;
+	input_text.astring = data;
+	input_text.length = len;
+
+	if(!atm->shared)
+		return -1;
+	return ac_automata_search_cursor(atm->shared->atm, &atm->cursor, &input_text, 1, __ac_match_handler, automata);
+}
+EXPORT_SYMBOL_GPL(ac_search);
+
+void ac_stream_init(ac_stream *stream)
+{
+	stream->generation = 0;
+	stream->state = 0;
+	stream->offset = 0;
+}
+EXPORT_SYMBOL_GPL(ac_stream_init);
+
+int ac_stream_resume(void *automata, const ac_stream *stream)
+{
+	struct automata *atm = (struct automata*)automata;
+	AC_AUTOMATA_t *shared_atm;
+
+	if(!atm->shared)
+		return -1;
+	shared_atm = atm->shared->atm;
+	/* state numbers are meaningful for the automata they are taken from */
+	if(stream->generation == atm->shared->generation &&
+			!ac_automata_cursor_set(shared_atm, &atm->cursor, stream->state, stream->offset))
+		return 0;
+	ac_automata_cursor_set(shared_atm, &atm->cursor, 0, stream->offset);
+	return stream->generation ? 1 : 0;
+}
+EXPORT_SYMBOL_GPL(ac_stream_resume);
+
+int ac_stream_save(void *automata, ac_stream *stream)
+{
+	struct automata *atm = (struct automata*)automata;
+
+	if(!atm->shared)
+		return -1;
+	stream->generation = atm->shared->generation;
+	stream->state = ac_automata_cursor_state(atm->shared->atm, &atm->cursor);
+	stream->offset = atm->cursor.base_position;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ac_stream_save);
+
+int ac_searchv(void *automata, const ac_iovec *iov, unsigned iovcnt)
+{
+	unsigned i;
+
+	for(i = 0; i < iovcnt; i++)
+		if(ac_search(automata, iov[i].iov_base, iov[i].iov_len))
+			return -1;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ac_searchv);
+
+/* automatas searched together by ac_search_batch */
+#define AC_SEARCH_BATCH 16
+
+int ac_search_batch(void *automatas[], const void *data[], const unsigned len[], unsigned num)
+{
+	AC_CURSOR_t *cursors[AC_SEARCH_BATCH];
+	AC_TEXT_t texts[AC_SEARCH_BATCH];
+	void *params[AC_SEARCH_BATCH];
+	AC_AUTOMATA_t *group = NULL;
+	struct automata *atm;
+	unsigned i, n = 0;
+
+	for(i = 0; i < num; i++)
+		if(!((struct automata*)automatas[i])->shared)
+			return -1;
+	for(i = 0; i < num; i++) {
+		atm = (struct automata*)automatas[i];
+		/* texts of a group are searched with one automata */
+		if(n && (n == AC_SEARCH_BATCH || atm->shared->atm != group)) {
+			ac_automata_search_batch(group, cursors, texts, n, __ac_match_handler, params);
+			n = 0;
+		}
+		group = atm->shared->atm;
+		cursors[n] = &atm->cursor;
+		texts[n].astring = data[i];
+		texts[n].length = len[i];
+		params[n++] = atm;
+	}
+	if(n)
+		ac_automata_search_batch(group, cursors, texts, n, __ac_match_handler, params);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ac_search_batch);
+
+#ifdef __KERNEL__
+int ac_search_skb(void *automata, const struct sk_buff *skb, unsigned offset, unsigned len)
+{
+	struct skb_seq_state st;
+	const u8 *data;
+	unsigned consumed = 0;
+	unsigned l;
+
+	if(!((struct automata*)automata)->shared)
+		return -1;
+	skb_prepare_seq_read((struct sk_buff *)skb, offset, offset + len, &st);
+	/* returns 0 and releases the state after the last block */
+	while((l = skb_seq_read(consumed, &data, &st)) != 0) {
+		if(ac_search(automata, data, l)) {
+			/* state is released only by reading to the end */
+			skb_abort_seq_read(&st);
+			return -1;
+		}
+		consumed += l;
+	}
+	return 0;
+}
+EXPORT_SYMBOL_GPL(ac_search_skb);
 #endif
-    ac_free(*patterns);
+
+struct ac_search_cb_param {
+	ac_patterns bundle;
+	ac_match_cb cb;
+	void *param;
+};
+
+static ac_pattern *__ac_bundle_pattern(ac_patterns bundle, int num);
+
+int __ac_match_cb_handler (AC_MATCH_t * matchp, void * param)
+{
+	struct ac_search_cb_param *p = (struct ac_search_cb_param*)param;
+	ac_pattern *patt = NULL;
+	unsigned int j;
+	int num;
+
+	for (j=0; j < matchp->match_num; j++) {
+		num = matchp->patterns[j].rep.number;
+		if(p->bundle) {
+			if(p->bundle->bits && !__ac_test_bit(p->bundle->bits, num))
+				continue;
+			patt = __ac_bundle_pattern(p->bundle, num);
+			if(!patt)
+				continue;
+		}
+		if(p->cb(patt, num, matchp->position, p->param))
+			return 1;
+	}
 	return 0;
 }
-EXPORT_SYMBOL_GPL(ac_remove_patterns);
 
-void ac_free_automata(void * domain_id, int cpu)
+int ac_search_cb(void *automata, const void *data, unsigned len, ac_patterns *patterns, ac_match_cb cb, void *param)
 {
-	struct domain *dom = (struct domain *)domain_id;
-	struct automata *atm;
-	struct automata *atm_safe;
+	AC_TEXT_t input_text;
+	struct automata *atm = (struct automata*)automata;
+	struct ac_search_cb_param p;
 
-	list_for_each_entry_safe(atm, atm_safe, &dom->automatas[cpu].leased, list)
-		if( atm->freed ) {
-			list_del(&atm->list);
-			atm->freed = 0;
-			atomic_dec(&atm->use);
-			AC_DEBUG("ac_free_automata: atm: %p rebuilding: %d\n", atm, dom->automatas[cpu].rebuilding);
-			if(dom->automatas[cpu].rebuilding)
-				atm->dirty = 1;
-			if(atm->dirty) {
-#ifdef __KERNEL__
-				if( !queue_work_on(cpu, dom->wq, &atm->work) )
-					AC_ERROR("ac_free_automata error queue work\n");
-#else
-				__ac_automata_rebuild(atm);
-#endif
+	input_text.astring = data;
+	input_text.length = len;
+	p.bundle = patterns ? *patterns : NULL;
+	p.cb = cb;
+	p.param = param;
+
+	if(!atm->shared)
+		return -1;
+	return ac_automata_search_cursor(atm->shared->atm, &atm->cursor, &input_text, 1, __ac_match_cb_handler, &p);
+}
+EXPORT_SYMBOL_GPL(ac_search_cb);
+
+#ifndef __KERNEL__
+/* chunks shorter than it are not worth a thread */
+#define AC_PARALLEL_CHUNK_MIN (64*1024)
+/* AC_TEXT_t length is unsigned int, longer chunks are searched by slices */
+#define AC_PARALLEL_SLICE (1UL << 30)
+
+/* chunk of ac_search_parallel, owns matches ending in (start, end] */
+struct ac_parallel_chunk {
+	struct shared_automata *shared;
+	ac_patterns bundle;
+	AC_MATCH_MODE_t mode;
+	const unsigned char *data;
+	unsigned long from; /* search start, before start by max length - 1 */
+	unsigned long start;
+	unsigned long end;
+	struct match *match; /* owned matches in end order, ac_vmalloc */
+	unsigned long match_num;
+	unsigned long match_size;
+	int error;
+	pthread_t thread;
+	int started; /* thread was created */
+};
+
+static int __ac_parallel_handler(AC_MATCH_t *matchp, void *param)
+{
+	struct ac_parallel_chunk *chunk = (struct ac_parallel_chunk *)param;
+	unsigned long end = chunk->from + matchp->position;
+	struct match *match;
+	unsigned int j;
+	int num;
+
+	/* overlap matches are found by the previous chunk too */
+	if(end <= chunk->start)
+		return 0;
+	for(j = 0; j < matchp->match_num; j++) {
+		num = matchp->patterns[j].rep.number;
+		if(chunk->bundle) {
+			if(chunk->bundle->bits && !__ac_test_bit(chunk->bundle->bits, num))
+				continue;
+			if(!__ac_bundle_pattern(chunk->bundle, num))
+				continue;
+		}
+		if(chunk->match_num == chunk->match_size) {
+			match = ac_vmalloc(2 * chunk->match_size * sizeof(*match));
+			if(!match) {
+				chunk->error = -ENOMEM;
+				return 1;
 			}
-			list_add_tail(&atm->list, &dom->automatas[cpu].free);
+			memcpy(match, chunk->match, chunk->match_num * sizeof(*match));
+			ac_vfree(chunk->match);
+			chunk->match = match;
+			chunk->match_size *= 2;
 		}
-	dom->automatas[cpu].rebuilding = 0;
+		match = &chunk->match[chunk->match_num++];
+		match->num = num;
+		match->length = matchp->patterns[j].length;
+		match->end = end;
+	}
+	return 0;
 }
 
-void ac_free_automatas(void * domain_id)
+static void *__ac_parallel_worker(void *param)
 {
-	int i;
-	for(i = 0; i < nr_cpu_ids ; i++ ) {
-		ac_free_automata(domain_id, i);
+	struct ac_parallel_chunk *chunk = (struct ac_parallel_chunk *)param;
+	AC_CURSOR_t cursor;
+	AC_TEXT_t text;
+	unsigned long pos;
+
+	chunk->match_size = AC_MATCH_BUFFER_SIZE;
+	chunk->match = ac_vmalloc(chunk->match_size * sizeof(*chunk->match));
+	if(!chunk->match) {
+		chunk->error = -ENOMEM;
+		return NULL;
 	}
+	ac_automata_cursor_reset(chunk->shared->atm, &cursor);
+	cursor.mode = chunk->mode;
+	for(pos = chunk->from; pos < chunk->end && !chunk->error; pos += text.length) {
+		text.astring = (const AC_ALPHABET_t *)chunk->data + pos;
+		text.length = chunk->end - pos < AC_PARALLEL_SLICE ? chunk->end - pos : AC_PARALLEL_SLICE;
+		ac_automata_search_cursor(chunk->shared->atm, &cursor, &text, 1, __ac_parallel_handler, chunk);
+	}
+	return NULL;
 }
 
-void *ac_get_automata(void * domain_id)
+int ac_search_parallel(void *domain_id, const void *data, unsigned long len, unsigned threads, unsigned mode, ac_patterns *patterns, ac_match_cb cb, void *param)
 {
 	struct domain *dom = (struct domain *)domain_id;
-	struct automata *atm = NULL;
-	struct automata *atm_safe = NULL;
-    struct ac_match *match;
-    struct ac_match *match_safe;
-
-	int cpu = get_cpu();
-	ac_free_automata(domain_id, cpu);
-	list_for_each_entry_safe(atm, atm_safe, &dom->automatas[cpu].free, list) {
-		if(atomic_inc_zero(&atm->use)) {
-			AC_DEBUG("ac_get_automata: got atm: %p\n", atm);
-			list_del(&atm->list);
-			list_add_tail(&atm->list, &dom->automatas[cpu].leased);
-            list_for_each_entry_safe(match, match_safe, &atm->match, list) {
-                list_del(&match->list);
-                ac_free(match);
-            }
-			break;
+	struct shared_automata *shared;
+	struct ac_parallel_chunk *chunks;
+	struct match *match;
+	ac_pattern *patt = NULL;
+	unsigned long size;
+	unsigned long overlap;
+	unsigned long i, j;
+	int ret = 0;
+
+	if(!threads || (mode != AC_MODE_ALL && mode != AC_MODE_LONGEST))
+		return -EINVAL;
+	if(threads > len / AC_PARALLEL_CHUNK_MIN)
+		threads = len / AC_PARALLEL_CHUNK_MIN ? len / AC_PARALLEL_CHUNK_MIN : 1;
+	chunks = ac_zmalloc(threads * sizeof(*chunks));
+	if(!chunks)
+		return -ENOMEM;
+	shared = __ac_shared_lease(dom);
+	if(!shared) {
+		ac_free(chunks);
+		return -EINVAL;
+	}
+	/*
+	 * a match ending in the chunk starts at most max length - 1 bytes
+	 * before it, so every match is found by the chunk of its end
+	 */
+	overlap = shared->atm->max_length ? shared->atm->max_length - 1 : 0;
+	size = len / threads;
+	for(i = 0; i < threads; i++) {
+		chunks[i].shared = shared;
+		chunks[i].bundle = patterns ? *patterns : NULL;
+		chunks[i].mode = mode;
+		chunks[i].data = data;
+		chunks[i].start = i * size;
+		chunks[i].end = i == threads - 1 ? len : (i + 1) * size;
+		chunks[i].from = chunks[i].start > overlap ? chunks[i].start - overlap : 0;
+	}
+	/* the calling thread searches the first chunk, or all if threads fail */
+	for(i = 1; i < threads; i++)
+		chunks[i].started = !pthread_create(&chunks[i].thread, NULL, __ac_parallel_worker, &chunks[i]);
+	for(i = 0; i < threads; i++)
+		if(!chunks[i].started)
+			__ac_parallel_worker(&chunks[i]);
+	for(i = 1; i < threads; i++)
+		if(chunks[i].started)
+			pthread_join(chunks[i].thread, NULL);
+
+	/* chunks are in offset order, matches of a chunk are in end order */
+	for(i = 0; i < threads; i++)
+		if(chunks[i].error)
+			ret = -1;
+	for(i = 0; i < threads && !ret; i++) {
+		for(j = 0; j < chunks[i].match_num; j++) {
+			match = &chunks[i].match[j];
+			if(patterns)
+				patt = __ac_bundle_pattern(*patterns, match->num);
+			if(cb(patt, match->num, match->end, param)) {
+				ret = 1;
+				break;
+			}
 		}
-		atm = NULL;
 	}
-	put_cpu();
-	return atm;
+	for(i = 0; i < threads; i++)
+		ac_vfree(chunks[i].match);
+	ac_free(chunks);
+	__ac_shared_unlease(dom, shared);
+	return ret;
 }
-EXPORT_SYMBOL_GPL(ac_get_automata);
+#endif
 
-void ac_put_automata(void * domain_id, void *automata)
+int ac_match_mode(void *automata, unsigned mode)
 {
 	struct automata *atm = (struct automata*)automata;
 
-	AC_DEBUG("ac_put_automata: put atm: %p\n", atm);
-	atm->freed = 1;
+	switch(mode) {
+	case AC_MODE_ALL:
+		atm->cursor.mode = AC_MATCH_ALL;
+		break;
+	case AC_MODE_LONGEST:
+		atm->cursor.mode = AC_MATCH_LONGEST;
+		break;
+	case AC_MODE_LEFTMOST_LONGEST:
+		atm->cursor.mode = AC_MATCH_LEFTMOST_LONGEST;
+		break;
+	default:
+		AC_ERROR("ac_match_mode: unknown mode %u\n", mode);
+		return -1;
+	}
+	return 0;
 }
-EXPORT_SYMBOL_GPL(ac_put_automata);
+EXPORT_SYMBOL_GPL(ac_match_mode);
 
-int __ac_match_handler (AC_MATCH_t * matchp, void * param)
+int __ac_first_handler (AC_MATCH_t * matchp, void * param)
 {
-    unsigned int j;
-	struct automata *atm = (struct automata*)param;
-    struct ac_match *match;
-    for (j=0; j < matchp->match_num; j++) {
-        AC_DEBUG ("\t__ac_match_handler %lu (%s)\n", matchp->patterns[j].rep.number, matchp->patterns[j].astring);
-		/* TODO: if pattern changed since search started - do not mark it here */
-        match = ac_malloc_atomic(sizeof(*match));
-        if(!match)
-        {
-            AC_ERROR_RATELIMIT("ac_module: out of memory\n");
-            return -1;
-        }
-        match->num = matchp->patterns[j].rep.number;
-        list_add_tail(&match->list, &atm->match);
+	ac_patterns bundle = (ac_patterns)param;
+	unsigned int j;
+	int num;
+
+	for (j=0; j < matchp->match_num; j++) {
+		num = matchp->patterns[j].rep.number;
+		if(bundle->bits ? __ac_test_bit(bundle->bits, num) : __ac_bundle_pattern(bundle, num) != NULL)
+			return 1;
 	}
-
-    return 0;
+	return 0;
 }
 
-int ac_search(void *automata, const void *data, unsigned len)
+int ac_search_first(void *automata, const void *data, unsigned len, ac_patterns *patterns)
 {
-    AC_TEXT_t input_text;
+	AC_TEXT_t input_text;
 	struct automata *atm = (struct automata*)automata;
+	ac_patterns bundle = *patterns;
+	AC_MATCH_MODE_t mode;
+	unsigned bit;
+	int ret;
+
 	input_text.astring = data;
 	input_text.length = len;
 
-	return ac_automata_search(atm->atm, &input_text, 1, __ac_match_handler, automata);
+	if(!atm->shared)
+		return -1;
+	if(bundle->tag) {
+		bit = __ac_ffs(bundle->tag);
+		/* masks don't have patterns added to bundle after automata build */
+		if(atm->shared->tags_seq[bit] == READ_ONCE(atm->domain->tags_seq[bit]))
+			return ac_automata_search_mask(atm->shared->atm, &atm->cursor, &input_text, 1,
+					bundle->tag, __ac_first_handler, bundle);
+	}
+	/* a longer pattern of other bundle must not hide the bundle ones */
+	mode = atm->cursor.mode;
+	atm->cursor.mode = AC_MATCH_ALL;
+	ret = ac_automata_search_cursor(atm->shared->atm, &atm->cursor, &input_text, 1, __ac_first_handler, bundle);
+	atm->cursor.mode = mode;
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ac_search_first);
+
+/* bundle entry of pattern number */
+static ac_pattern *__ac_bundle_pattern(ac_patterns bundle, int num)
+{
+    ac_pattern *patt;
+
+    hlist_for_each_entry(patt, bundle->hash + num % AC_PATTERNS_HSIZE, list)
+        if(num == ((struct pattern*)patt->pattern)->num)
+            return patt;
+    return NULL;
 }
-EXPORT_SYMBOL_GPL(ac_search);
+
+static void __ac_clear_match_bits(struct automata *atm)
+{
+	unsigned i;
+
+	/* clear bits of stored matches or whole used range if some are lost */
+	if(atm->match_overflow || atm->match_num == AC_MATCH_BUFFER_SIZE) {
+		if(atm->match_bits_lo < atm->match_bits_hi)
+			memset(atm->match_bits + atm->match_bits_lo, 0,
+				(atm->match_bits_hi - atm->match_bits_lo)*sizeof(long));
+	}
+	else
+		for(i = 0; i < atm->match_num; i++)
+			__ac_clear_bit(atm->match_bits, atm->match[i].num);
+	atm->match_bits_lo = BITS_TO_LONGS(atm->domain->patterns_number);
+	atm->match_bits_hi = 0;
+}
+
+/*
+ * AC_DOMAIN_MATCH_BITSET: matched patterns of bundle are set bits of
+ * automata and bundle bitsets AND, *next is number of next bit to check + 1
+ */
+static ac_pattern *__ac_next_match_bits(unsigned long *next, struct automata *atm, ac_patterns bundle)
+{
+	unsigned long word;
+	unsigned long bit;
+	ac_pattern *patt;
+	unsigned i;
+
+	if(!bundle->bits)
+		return NULL;
+	bit = *next ? *next - 1 : atm->match_bits_lo * BITS_PER_LONG;
+	for(i = bit / BITS_PER_LONG; i < atm->match_bits_hi; i++) {
+		word = atm->match_bits[i] & bundle->bits[i];
+		if(i == bit / BITS_PER_LONG)
+			word &= ~0UL << (bit % BITS_PER_LONG);
+		while(word) {
+			bit = i * BITS_PER_LONG + __ac_ffs(word);
+			word &= word - 1;
+			*next = bit + 2;
+			patt = __ac_bundle_pattern(bundle, bit);
+			if(patt)
+				return patt;
+		}
+	}
+	*next = atm->match_bits_hi * BITS_PER_LONG + 1;
+	return NULL;
+}
+
+int ac_patterns_matched(void *automata, ac_patterns *patterns)
+{
+	struct automata *atm = (struct automata*)automata;
+	void *match = 0;
+	unsigned i;
+
+	if(atm->match_bits && (*patterns)->bits) {
+		for(i = atm->match_bits_lo; i < atm->match_bits_hi; i++)
+			if(atm->match_bits[i] & (*patterns)->bits[i])
+				return 1;
+		return 0;
+	}
+	return ac_next_match(&match, automata, patterns) != NULL;
+}
+EXPORT_SYMBOL_GPL(ac_patterns_matched);
 
 ac_pattern* ac_next_match(void **patt_match, void *automata, ac_patterns *patterns)
 {
-    struct ac_match **match = (struct ac_match **)patt_match;
+    struct match **match = (struct match **)patt_match;
 	struct automata *atm = (struct automata*)automata;
     ac_pattern *patt;
+    unsigned long next;
 
-    if(list_empty(&atm->match))
-        return NULL;
+    if(atm->match_bits) {
+        next = (unsigned long)*patt_match;
+        patt = __ac_next_match_bits(&next, atm, *patterns);
+        *patt_match = (void *)next;
+        return patt;
+    }
 
     if(*match == 0)
-        *match = list_prepare_entry((*match), &atm->match, list);
-    list_for_each_entry_continue((*match), &atm->match, list) {
-        hlist_for_each_entry(patt, (*patterns + (*match)->num % AC_PATTERNS_HSIZE), list) {
+        *match = atm->match;
+    else
+        ++*match;
+    for(; *match < atm->match + atm->match_num; ++*match) {
+        hlist_for_each_entry(patt, ((*patterns)->hash + (*match)->num % AC_PATTERNS_HSIZE), list) {
             if((*match)->num == ((struct pattern*)patt->pattern)->num)
                 return patt;
         }
@@ -528,6 +1876,50 @@ ac_pattern* ac_next_match(void **patt_match, void *automata, ac_patterns *patter
 }
 EXPORT_SYMBOL_GPL(ac_next_match);
 
+/* stored match of ac_next_match position, NULL if it is not stored */
+static struct match *__ac_match_of(void *patt_match, struct automata *atm)
+{
+	unsigned long next = (unsigned long)patt_match;
+	unsigned i;
+
+	if(!atm->match_bits)
+		return (struct match *)patt_match;
+	/* bitset keeps the first match of each pattern in match[] */
+	if(next < 2)
+		return NULL;
+	for(i = 0; i < atm->match_num; i++)
+		if(atm->match[i].num == next - 2)
+			return atm->match + i;
+	return NULL;
+}
+
+long ac_match_end(void *patt_match, void *automata)
+{
+	struct match *m = __ac_match_of(patt_match, (struct automata*)automata);
+
+	if(!m)
+		return -1;
+	return m->end;
+}
+EXPORT_SYMBOL_GPL(ac_match_end);
+
+long ac_match_start(void *patt_match, void *automata)
+{
+	struct match *m = __ac_match_of(patt_match, (struct automata*)automata);
+
+	if(!m)
+		return -1;
+	return m->end - m->length;
+}
+EXPORT_SYMBOL_GPL(ac_match_start);
+
+unsigned ac_match_overflow(void *automata)
+{
+	struct automata *atm = (struct automata*)automata;
+	return atm->match_overflow;
+}
+EXPORT_SYMBOL_GPL(ac_match_overflow);
+
 const char * ac_pattern_str(ac_pattern *pattern)
 {
 	struct pattern *patt = (struct pattern*)pattern->pattern;
@@ -541,123 +1933,217 @@ int __ac_clean_patterns(void * domain_id)
 	unsigned i;
 
 	for(i = 0; i < dom->patterns_number ; i++) {
-#ifdef __KERNEL__
 		spin_lock_bh(&dom->patterns[i].lock);
-#endif
 		if( dom->patterns[i].pattern ) {
-			ac_free( dom->patterns[i].pattern );
+			__ac_pattern_str_free( dom->patterns[i].pattern );
 			dom->patterns[i].pattern = NULL;
 		}
-#ifdef __KERNEL__
 		spin_unlock_bh(&dom->patterns[i].lock);
-#endif
 	}
 
 	return 0;
 }
 
-#ifdef __KERNEL__
-static void __ac_automata_rebuild( struct work_struct *work)
-#else
-void __ac_automata_rebuild(struct automata *atm)
-#endif
+static unsigned long __ac_pattern_tags(AC_PATTERN_t *pattern, void *param)
+{
+	struct domain *dom = (struct domain *)param;
+	return READ_ONCE(dom->patterns[pattern->rep.number].tags);
+}
+
+/* build automata from all used patterns of domain */
+struct shared_automata *__ac_shared_build(struct domain *dom)
 {
 	AC_PATTERN_t pattern;
 	AC_STATUS_t ac_status;
+	struct shared_automata *shared;
+	struct pattern* patterns = dom->patterns;
+	unsigned patt_num = dom->patterns_number;
 	unsigned i;
 
-#ifdef __KERNEL__
-	struct automata *atm = container_of(work, struct automata, work);
-#endif
-	struct pattern* patterns = atm->domain->patterns;
-	unsigned patt_num = atm->domain->patterns_number;
-
-	if(!atomic_inc_zero(&atm->use))
-	{
-	    AC_DEBUG("__ac_automatas_rebuild exits on busy\n");
-		return;
+	shared = __ac_cache_zalloc(ac_shared_cache, sizeof(*shared));
+	if(!shared) {
+		AC_ERROR("__ac_shared_build: can't allocate automata\n");
+		return NULL;
 	}
-
-	if(atm->atm)
-		ac_automata_release(atm->atm);
-	atm->atm = ac_automata_init(atm->ignorecase);
+	shared->atm = ac_automata_init(dom->flags & AC_DOMAIN_IGNORECASE);
+	if(!shared->atm) {
+		AC_ERROR("__ac_shared_build: can't allocate automata\n");
+		__ac_cache_free(ac_shared_cache, shared);
+		return NULL;
+	}
+	if(percpu_ref_init(&shared->refs, __ac_shared_release, 0, GFP_KERNEL)) {
+		AC_ERROR("__ac_shared_build: can't allocate automata\n");
+		ac_automata_release(shared->atm);
+		__ac_cache_free(ac_shared_cache, shared);
+		return NULL;
+	}
+	shared->generation = atomic_inc_return(&ac_generation);
+	/* masks of tagged bundle are valid until its tags_seq is changed */
+	for(i = 0; i < BITS_PER_LONG; i++)
+		shared->tags_seq[i] = READ_ONCE(dom->tags_seq[i]);
+	smp_rmb();
 	for(i = 0; i < patt_num; i++) {
-		if(patterns[i].use_count == 0)
+		if(READ_ONCE(patterns[i].use_count) == 0)
 			continue;
-#ifdef __KERNEL__
 		spin_lock_bh(&patterns[i].lock);
-#endif
 		pattern.astring = patterns[i].pattern;
 		pattern.length = strlen(patterns[i].pattern);
 		pattern.rep.number = i;
-		ac_status = ac_automata_add(atm->atm, &pattern);
+		ac_status = ac_automata_add(shared->atm, &pattern);
 		if(ac_status != ACERR_SUCCESS) {
-			AC_ERROR("__ac_automatas_rebuild: wrong status %d for pattern %s. Skip it.\n", ac_status, patterns[i].pattern);
+			AC_ERROR("__ac_shared_build: wrong status %d for pattern %s. Skip it.\n", ac_status, patterns[i].pattern);
 		}
-#ifdef __KERNEL__
 		spin_unlock_bh(&patterns[i].lock);
-#endif
 	}
-	ac_automata_finalize(atm->atm);
-	atm->dirty = 0;
-	atomic_dec(&atm->use);
+	if(ac_automata_finalize(shared->atm)) {
+		AC_ERROR("__ac_shared_build: can't finalize automata\n");
+		percpu_ref_exit(&shared->refs);
+		ac_automata_release(shared->atm);
+		__ac_cache_free(ac_shared_cache, shared);
+		return NULL;
+	}
+	if(dom->tags)
+		ac_automata_mask(shared->atm, __ac_pattern_tags, dom);
+	if((dom->flags & AC_DOMAIN_COMPILED) && ac_automata_compile(shared->atm))
+		AC_ERROR("__ac_shared_build: can't compile automata, search with trie\n");
+	shared->domain = dom;
+	__ac_shared_account(shared, 1);
+
+	return shared;
 }
 
-int __ac_automatas_rebuild(struct list_head *automatas, struct pattern *patterns, unsigned patt_num, int cpu)
+/* automata memory is accounted while the automata has references */
+static void __ac_shared_account(struct shared_automata *shared, long sign)
 {
-	struct automata *atm;
+	unsigned long nodes, edges, table;
 
-	list_for_each_entry(atm, automatas, list) {
-		atm->dirty = 1;
-		AC_DEBUG("queue rebuild cpu: %d atm:%p\n", cpu, atm);
-#ifdef __KERNEL__
-		if( !queue_work_on(cpu, atm->domain->wq, &atm->work) ) {
-			AC_ERROR("__ac_automatas_rebuild error queue work\n");
-			return -1;
-		}
-#else
-		__ac_automata_rebuild(atm);
-#endif
-	}
+	ac_automata_memory(shared->atm, &nodes, &edges, &table);
+	__ac_mem_account(shared->domain, AC_MEM_NODES, sign * (long)nodes);
+	__ac_mem_account(shared->domain, AC_MEM_EDGES, sign * (long)edges);
+	__ac_mem_account(shared->domain, AC_MEM_TABLE, sign * (long)table);
+}
 
-	return 0;
+/* 
+ * take reference on the published automata, lock-free and cpu local.
+ * refs is killed only after the automata was replaced or unpublished,
+ * so retry with the new one
+ */
+struct shared_automata *__ac_shared_get(struct domain *dom)
+{
+	struct shared_automata *shared;
+
+	rcu_read_lock();
+	do {
+		shared = rcu_dereference(dom->shared);
+	} while(shared && !percpu_ref_tryget_live(&shared->refs));
+	rcu_read_unlock();
+	return shared;
 }
 
-int __ac_domain_rebuild(struct domain *dom)
+/*
+ * reference on the current automata without automata lease, counted as
+ * lease so ac_remove_domain fails until it is released
+ */
+static struct shared_automata *__ac_shared_lease(struct domain *dom)
 {
-	int i;
-	for(i = 0; i < nr_cpu_ids ; i++ ) {
-		__ac_automatas_rebuild(&dom->automatas[i].free, dom->patterns, dom->patterns_number, i);
-		dom->automatas[i].rebuilding = 1;
-	}
+	struct shared_automata *shared;
+
+	rcu_read_lock();
+	atomic_inc(&dom->shared_leased);
+	shared = __ac_domain_dying(dom) ? NULL : __ac_shared_get(dom);
+	if(!shared)
+		atomic_dec(&dom->shared_leased);
+	rcu_read_unlock();
+	return shared;
+}
 
-	return 0;
+static void __ac_shared_unlease(struct domain *dom, struct shared_automata *shared)
+{
+	__ac_shared_put(shared);
+	atomic_dec(&dom->shared_leased);
+}
+
+static void __ac_shared_free_rcu(struct rcu_head *head)
+{
+	struct shared_automata *shared = container_of(head, struct shared_automata, rcu);
+
+	AC_DEBUG("__ac_shared_free_rcu: release automata %p\n", shared);
+	percpu_ref_exit(&shared->refs);
+	ac_automata_release(shared->atm);
+#ifndef __KERNEL__
+	if(shared->mapped)
+		munmap(shared->image, shared->image_size);
+	else
+#endif
+	if(shared->image)
+		ac_vfree(shared->image);
+	__ac_cache_free(ac_shared_cache, shared);
+}
+
+/* readers may still see the pointer, free after grace period */
+static void __ac_shared_release(struct percpu_ref *ref)
+{
+	struct shared_automata *shared = container_of(ref, struct shared_automata, refs);
+
+	/* __ac_free_domain waits for the release */
+	if(shared->domain)
+		__ac_shared_account(shared, -1);
+	call_rcu(&shared->rcu, __ac_shared_free_rcu);
 }
 
-void __ac_set_bit(uint8_t *mask, int n) 
+void __ac_shared_put(struct shared_automata *shared)
 {
-	mask[n/8] |= (1 << (n%8));
+	percpu_ref_put(&shared->refs);
 }
-int __ac_test_bit(uint8_t *mask, int n) 
+
+/* drop the domain reference of automata that is not published anymore */
+static void __ac_shared_kill(struct shared_automata *shared)
 {
-	return mask[n/8] & (1 << (n%8));
+	percpu_ref_kill(&shared->refs);
 }
-inline void __ac_clear_bit(uint8_t *mask, int n) 
+
+/* replace domain automata, cursors leased before keep the old one until put */
+static void __ac_domain_rebuild_work(struct work_struct *work)
 {
-	mask[n/8] &= ~(1 << (n%8));
+	struct shared_automata *shared;
+	struct shared_automata *old;
+	struct domain *dom = container_of(work, struct domain, rebuild_work);
+
+	shared = __ac_shared_build(dom);
+	if(!shared)
+		return;
+	/* rebuild_work is the only writer: work item is never run concurrently */
+	old = rcu_dereference_protected(dom->shared, 1);
+	rcu_assign_pointer(dom->shared, shared);
+	__ac_shared_kill(old);
 }
 
-atomic_t __ac_alloc;
-atomic_t __ac_free;
-atomic_t __ac_max_alloc;
+int __ac_domain_rebuild(struct domain *dom)
+{
+	AC_DEBUG("queue rebuild domain: %s\n", dom->name);
+	/* unused image patterns are not in automata after rebuild */
+	dom->image = 0;
+	queue_work(dom->wq, &dom->rebuild_work);
+	return 0;
+}
 
-inline void __ac_calc_max_alloc(void)
+void __ac_set_bit(unsigned long *mask, int n) 
 {
-	if(atomic_read(&__ac_alloc) - atomic_read(&__ac_free) 
-			> atomic_read(&__ac_max_alloc)) {
-		atomic_set(&__ac_max_alloc, atomic_read(&__ac_alloc) - atomic_read(&__ac_free));
-	}
+	mask[n/BITS_PER_LONG] |= (1UL << (n%BITS_PER_LONG));
 }
+int __ac_test_bit(unsigned long *mask, int n) 
+{
+	return (mask[n/BITS_PER_LONG] >> (n%BITS_PER_LONG)) & 1;
+}
+inline void __ac_clear_bit(unsigned long *mask, int n) 
+{
+	mask[n/BITS_PER_LONG] &= ~(1UL << (n%BITS_PER_LONG));
+}
+
+/* allocated and freed bytes of module, per cpu and summed by ac_meminfo */
+static DEFINE_PER_CPU(long, ac_mem_alloc);
+static DEFINE_PER_CPU(long, ac_mem_free);
+
 inline void *__ac_malloc(size_t sz, int gfp)
 {
 	void *ret = 
@@ -668,11 +2154,10 @@ inline void *__ac_malloc(size_t sz, int gfp)
 #endif
 
 #ifdef __KERNEL__
-	atomic_add(ksize(ret), &__ac_alloc);
+	this_cpu_add(ac_mem_alloc, ksize(ret));
 #else
-	__ac_alloc += malloc_usable_size(ret);
+	this_cpu_add(ac_mem_alloc, malloc_usable_size(ret));
 #endif
-	__ac_calc_max_alloc();
 	return ret;
 }
 
@@ -707,11 +2192,10 @@ inline void *__ac_zmalloc(size_t sz, int gfp)
 #endif
 	if(ret) {
 #ifdef __KERNEL__
-		atomic_add(ksize(ret), &__ac_alloc);
+		this_cpu_add(ac_mem_alloc, ksize(ret));
 #else
-		__ac_alloc += malloc_usable_size(ret);
+		this_cpu_add(ac_mem_alloc, malloc_usable_size(ret));
 #endif
-		__ac_calc_max_alloc();
 	}
 	return ret;
 }
@@ -737,20 +2221,157 @@ inline void *ac_zmalloc_atomic(size_t sz)
 inline void ac_free(void *ptr)
 {
 #ifdef __KERNEL__
-	atomic_add(ksize(ptr), &__ac_free);
+	this_cpu_add(ac_mem_free, ksize(ptr));
 	kfree(ptr);
 #else
-	__ac_free += malloc_usable_size(ptr);
+	this_cpu_add(ac_mem_free, malloc_usable_size(ptr));
 	free(ptr);
 #endif
 }
 
+#define AC_VMALLOC_HDR (2*sizeof(size_t))
+
+/* large allocations, e.g. compiled transition tables */
+void *ac_vmalloc(size_t sz)
+{
+	size_t *ret =
+#ifdef __KERNEL__
+	vmalloc(sz + AC_VMALLOC_HDR);
+#else
+	malloc(sz + AC_VMALLOC_HDR);
+#endif
+	if(!ret)
+		return NULL;
+	*ret = sz + AC_VMALLOC_HDR;
+#ifdef __KERNEL__
+	this_cpu_add(ac_mem_alloc, *ret);
+#else
+	this_cpu_add(ac_mem_alloc, *ret);
+#endif
+	return (char*)ret + AC_VMALLOC_HDR;
+}
+
+void ac_vfree(void *ptr)
+{
+	size_t *hdr;
+
+	if(!ptr)
+		return;
+	hdr = (size_t*)((char*)ptr - AC_VMALLOC_HDR);
+#ifdef __KERNEL__
+	this_cpu_add(ac_mem_free, *hdr);
+	vfree(hdr);
+#else
+	this_cpu_add(ac_mem_free, *hdr);
+	free(hdr);
+#endif
+}
+
+/* fixed size object of slab cache, ac_zmalloc in userspace */
+static void *__ac_cache_zalloc(struct kmem_cache *cache, size_t size)
+{
+#ifdef __KERNEL__
+	void *ret = kmem_cache_zalloc(cache, GFP_KERNEL);
+	if(ret)
+		this_cpu_add(ac_mem_alloc, kmem_cache_size(cache));
+	return ret;
+#else
+	return ac_zmalloc(size);
+#endif
+}
+
+static void __ac_cache_free(struct kmem_cache *cache, void *ptr)
+{
+#ifdef __KERNEL__
+	this_cpu_add(ac_mem_free, kmem_cache_size(cache));
+	kmem_cache_free(cache, ptr);
+#else
+	ac_free(ptr);
+#endif
+}
+
+/* bundle entries are allocated under domain lock, the reserve backs them */
+static ac_pattern *__ac_pattern_alloc(void)
+{
+#ifdef __KERNEL__
+	ac_pattern *ret = mempool_alloc(ac_pattern_reserve, GFP_ATOMIC);
+	if(ret) {
+		memset(ret, 0, sizeof(*ret));
+		this_cpu_add(ac_mem_alloc, kmem_cache_size(ac_pattern_cache));
+	}
+	return ret;
+#else
+	return ac_zmalloc(sizeof(ac_pattern));
+#endif
+}
+
+static void __ac_pattern_free(ac_pattern *entry)
+{
+#ifdef __KERNEL__
+	this_cpu_add(ac_mem_free, kmem_cache_size(ac_pattern_cache));
+	mempool_free(entry, ac_pattern_reserve);
+#else
+	ac_free(entry);
+#endif
+}
+
+/* pattern strings are allocated under domain lock too, short ones from reserve */
+static char *__ac_pattern_str_alloc(size_t size)
+{
+#ifdef __KERNEL__
+	char *ret;
+
+	if(size > AC_PATTERN_STR_SIZE)
+		return ac_malloc_atomic(size);
+	ret = mempool_alloc(ac_pattern_str_reserve, GFP_ATOMIC);
+	if(ret)
+		this_cpu_add(ac_mem_alloc, kmem_cache_size(ac_pattern_str_cache));
+	return ret;
+#else
+	return ac_malloc_atomic(size);
+#endif
+}
+
+static void __ac_pattern_str_free(char *str)
+{
+#ifdef __KERNEL__
+	if(strlen(str) + 1 > AC_PATTERN_STR_SIZE) {
+		ac_free(str);
+		return;
+	}
+	this_cpu_add(ac_mem_free, kmem_cache_size(ac_pattern_str_cache));
+	mempool_free(str, ac_pattern_str_reserve);
+#else
+	ac_free(str);
+#endif
+}
+
 void ac_meminfo(void)
 {
-	int ac_alloc = atomic_read(&__ac_alloc);
-	int ac_free = atomic_read(&__ac_free);
-	int max_alloc = atomic_read(&__ac_max_alloc);
-	AC_PRINT("meminfo: alloc: %d free: %d max_alloc: %d use:%d\n", ac_alloc, ac_free, max_alloc, ac_alloc-ac_free);
+	struct domain *dom;
+	struct ac_mem_stat *stat;
+	long alloc = 0, freed = 0;
+	long mem[AC_MEM_MAX];
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		alloc += per_cpu(ac_mem_alloc, cpu);
+		freed += per_cpu(ac_mem_free, cpu);
+	}
+	AC_PRINT("meminfo: alloc: %ld free: %ld use: %ld\n", alloc, freed, alloc - freed);
+	mutex_lock(&domains_lock);
+	list_for_each_entry(dom, &domains, list) {
+		memset(mem, 0, sizeof(mem));
+		for_each_possible_cpu(cpu) {
+			stat = per_cpu_ptr(dom->mem, cpu);
+			for(i = 0; i < AC_MEM_MAX; i++)
+				mem[i] += stat->bytes[i];
+		}
+		AC_PRINT("meminfo: domain %s: nodes: %ld edges: %ld table: %ld patterns: %ld matches: %ld\n",
+			dom->name, mem[AC_MEM_NODES], mem[AC_MEM_EDGES], mem[AC_MEM_TABLE],
+			mem[AC_MEM_PATTERNS], mem[AC_MEM_MATCHES]);
+	}
+	mutex_unlock(&domains_lock);
 #ifndef __KERNEL__
 	/* malloc_stats(); */
 #endif
@@ -758,12 +2379,46 @@ void ac_meminfo(void)
 EXPORT_SYMBOL_GPL(ac_meminfo);
 
 #ifdef __KERNEL__
+static void ac_destroy_caches(void)
+{
+	mempool_destroy(ac_pattern_str_reserve);
+	kmem_cache_destroy(ac_pattern_str_cache);
+	mempool_destroy(ac_pattern_reserve);
+	kmem_cache_destroy(ac_pattern_cache);
+	kmem_cache_destroy(ac_shared_cache);
+	kmem_cache_destroy(ac_automata_cache);
+}
+
 static int __init ac_init_module( void )
 {
+	int ret;
+
+	ac_automata_cache = kmem_cache_create("ac_automata", sizeof(struct automata), 0, SLAB_HWCACHE_ALIGN, NULL);
+	ac_shared_cache = kmem_cache_create("ac_shared_automata", sizeof(struct shared_automata), 0, 0, NULL);
+	ac_pattern_cache = kmem_cache_create("ac_pattern", sizeof(ac_pattern), 0, 0, NULL);
+	if(ac_pattern_cache)
+		ac_pattern_reserve = mempool_create_slab_pool(ac_reserve, ac_pattern_cache);
+	ac_pattern_str_cache = kmem_cache_create("ac_pattern_str", AC_PATTERN_STR_SIZE, 0, 0, NULL);
+	if(ac_pattern_str_cache)
+		ac_pattern_str_reserve = mempool_create_slab_pool(ac_reserve, ac_pattern_str_cache);
+	if(!ac_automata_cache || !ac_shared_cache || !ac_pattern_reserve || !ac_pattern_str_reserve) {
+		ac_destroy_caches();
+		return -ENOMEM;
+	}
+	ret = cpuhp_setup_state_multi(CPUHP_AP_ONLINE_DYN, "ac_module:online", __ac_cpu_online, NULL);
+	if(ret < 0) {
+		ac_destroy_caches();
+		return ret;
+	}
+	ac_cpuhp_state = ret;
 	return 0;
 }
 static void ac_cleanup_module( void )
 {
+	cpuhp_remove_multi_state(ac_cpuhp_state);
+	/* wait for automatas released with call_rcu */
+	rcu_barrier();
+	ac_destroy_caches();
 }
 module_init(ac_init_module);
 module_exit(ac_cleanup_module);
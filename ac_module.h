@@ -1,6 +1,6 @@
 /**
  *  Aho-Corasick search framework header file
- *  compiles as linux kernel module for SMP or as single-thread userspace library
+ *  compiles as linux kernel module for SMP or as multi-thread userspace library
  *  compiles with modified multifast-v1.4.2 (C) Kamiar Kanani <kamiar.kanani@gmail.com>
  *  (C) 2015 Ilya Gavrilov <gilyav@gmail.com>
  *
@@ -11,42 +11,171 @@
  */
 
 #ifndef __KERNEL__
+#include <sys/uio.h>
 #include "list.h"
+typedef struct iovec ac_iovec;
 #else
+#include <linux/uio.h>
 #include <linux/list.h>
 #include <linux/smp.h>
 #include <linux/cpumask.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+typedef struct kvec ac_iovec;
+struct sk_buff;
 #endif
 
-#define REALLOC_CHUNK_ALLNODES 20000
+/*
+ * matches stored by automata for one lease, preallocated with automata.
+ * when it is full next matches are dropped and counted by ac_match_overflow
+ */
+#define AC_MATCH_BUFFER_SIZE	64
+
+/* ac_add_domain flags */
+#define AC_DOMAIN_IGNORECASE	0x01 /* case unsensitive search (ascii only) */
+#define AC_DOMAIN_COMPILED	0x02 /* search with compiled transition table */
+#define AC_DOMAIN_MATCH_BITSET	0x04 /* matches are kept as bitset of patterns */
+
+#ifndef __KERNEL__
+/* maximum ac_init_threads workers */
+#define AC_THREADS_MAX		128
+
+/* ac_init_threads flags */
+#define AC_THREADS_REBUILD	0x01 /* rebuild automatas in domain thread */
+#endif
+
+/* ac_match_mode modes */
+#define AC_MODE_ALL		0 /* all matches, overlapping ones too */
+#define AC_MODE_LONGEST		1 /* the longest pattern at each match end */
+#define AC_MODE_LEFTMOST_LONGEST 2 /* non-overlapping leftmost longest matches */
+
+#define AC_PATTERNS_HSIZE 200 /* TODO: use as param */
 
 typedef struct {
 	struct hlist_node list;
 	void *pattern;
 } ac_pattern;
 
-typedef struct hlist_head* ac_patterns;
+typedef struct {
+	struct hlist_head hash[AC_PATTERNS_HSIZE]; /* ac_pattern by number */
+	unsigned long *bits; /* member patterns, AC_DOMAIN_MATCH_BITSET only */
+	unsigned long tag; /* bundle bit in automata masks, see ac_patterns_tag */
+} ac_patterns_bundle;
+
+typedef ac_patterns_bundle* ac_patterns;
+
+/*
+ * search state of a stream detached from automata lease, e.g. to keep it
+ * per flow between packets. it is plain data and can be copied.
+ */
+typedef struct {
+	unsigned generation; /* automata of the state, 0 for a new stream */
+	unsigned state; /* automata state */
+	unsigned long offset; /* stream offset of the next data */
+} ac_stream;
 
 /**
  * ac_add_domain - create new domain 
  * @doman - domain name
- * @automatas_number - number of automatas for each cpu for this domain
+ * @automatas_number - number of search cursors for each cpu for this domain,
+ *   all cursors share one automata built from domain patterns
  * @patterns_number - maximum patterns number can be added to this domain
- * @ignorecase - case unsensitive search inside domain (ascii only)
+ * @flags - AC_DOMAIN_* flags:
+ *   AC_DOMAIN_IGNORECASE - case unsensitive search inside domain (ascii only)
+ *   AC_DOMAIN_COMPILED - automatas are compiled into flat transition tables
+ *   after each rebuild: one table lookup per input byte, more memory per node
+ *   AC_DOMAIN_MATCH_BITSET - each automata and patterns bundle keeps a bitset
+ *   of patterns_number bits: ac_next_match reports every matched pattern once
+ *   and is a word-wise AND with the bundle, not limited by
+ *   AC_MATCH_BUFFER_SIZE
  * 
  * @return - pointer to domain or NULL on error
  */
-void * ac_add_domain(const char* domain, unsigned automatas_number, unsigned patterns_number, int ignorecase);
+void * ac_add_domain(const char* domain, unsigned automatas_number, unsigned patterns_number, unsigned flags);
+
+/**
+ * ac_save_domain - serialize compiled automata of domain
+ * @domain_id - pointer to domain, created with AC_DOMAIN_COMPILED
+ * @image - buffer aligned to sizeof(long) or NULL to get image size
+ * @size - size of image buffer
+ *
+ * the image holds transition table and pattern strings, it has no pointers
+ * and can be loaded on the same architecture by ac_load_domain
+ *
+ * @return image size, -ENOSPC if buffer is too small, < 0 on other errors
+ */
+long ac_save_domain(void * domain_id, void *image, unsigned long size);
+
+/**
+ * ac_load_domain - create domain from image made by ac_save_domain
+ * @domain - domain name
+ * @image - image, it is copied (vmalloc in kernel)
+ * @size - image size
+ * @automatas_number, @patterns_number - see ac_add_domain,
+ *   patterns_number must cover all patterns of the image
+ *
+ * flags (AC_DOMAIN_COMPILED and AC_DOMAIN_IGNORECASE) are taken from image.
+ * image patterns are not used by any bundle: ac_add_patterns with the same
+ * strings adds them to bundles without automata rebuild. any rebuild keeps
+ * only patterns used by bundles.
+ *
+ * @return pointer to domain or NULL on error
+ */
+void * ac_load_domain(const char *domain, const void *image, unsigned long size, unsigned automatas_number, unsigned patterns_number);
+
+#ifndef __KERNEL__
+/**
+ * ac_save_domain_file - write ac_save_domain image to file
+ *
+ * @return 0 on success, < 0 on error
+ */
+int ac_save_domain_file(void * domain_id, const char *path);
+
+/**
+ * ac_load_domain_file - ac_load_domain from file
+ *
+ * the file is mmaped and used in place, processes loading the same
+ * file share its pages
+ */
+void * ac_load_domain_file(const char *domain, const char *path, unsigned automatas_number, unsigned patterns_number);
+
+/**
+ * ac_init_threads - configure userspace threads, before the first domain
+ * @workers - number of slots standing for kernel cpus, 1..AC_THREADS_MAX.
+ *   each domain has automatas_number automatas per slot, a thread is mapped
+ *   to a slot on its first call and leases automatas of its slot. threads
+ *   sharing a slot are serialized on lease
+ * @flags - AC_THREADS_REBUILD: automata is rebuilt by a thread of domain as
+ *   in kernel, pattern changes are searched after rebuild (see
+ *   ac_flush_domain). without it rebuild runs in the changing call
+ *
+ * default is 1 worker and rebuild in the changing call
+ *
+ * @return 0 on success, -EINVAL for wrong workers, -EBUSY if domains exist
+ */
+int ac_init_threads(unsigned workers, unsigned flags);
+#endif
 
 /**
  * ac_remove_domain - delete domain
  * domain_id - pointer to domain
  *
- * @return 0 on success, < 0 on errnor
+ * fails while automatas are leased or ac_save_domain/ac_search_parallel
+ * of the domain run
+ *
+ * @return 0 on success, -EBUSY if patterns of domain are being changed,
+ * < 0 on other errors
  */
 int ac_remove_domain(void * domain_id);
 
+/**
+ * ac_flush_domain - wait until queued automata rebuild of domain is done
+ * @domain_id - pointer to domain
+ *
+ * automatas leased after it search with patterns changed before it
+ */
+void ac_flush_domain(void * domain_id);
+
 /**
  * ac_patterns_init - init patterns bundle before using
  * @patt - pointer to pattern bundle
@@ -68,6 +197,20 @@ int ac_patterns_init(ac_patterns *patt);
  */
 int ac_add_patterns(void * domain_id, const char *patts[], unsigned patterns_num, ac_patterns* patterns);
 
+/**
+ * ac_patterns_tag - speed up ac_search_first for patterns bundle
+ * @domain_id - pointer to domain of bundle
+ * @patterns - pointer to pattern bundle
+ *
+ * automata nodes get the bundle tag bit when they match bundle patterns, so
+ * ac_search_first checks only positions of bundle patterns. there are
+ * BITS_PER_LONG tags per domain. changes of tagged bundle rebuild automata,
+ * until the rebuild ac_search_first checks all matches of the bundle.
+ *
+ * @return 0 on success, -ENOSPC if all tags are used, < 0 on other errors
+ */
+int ac_patterns_tag(void * domain_id, ac_patterns *patterns);
+
 /**
  * ac_remove_patterns - remove patterns bundle from domain
  * @domain_id - pointer to domain for remove
@@ -83,7 +226,8 @@ int ac_remove_patterns(void * domain_id, ac_patterns *patterns);
  * ac_get_automata - get automata from domain to search
  * @domain - domain id
  *
- * @return automata ready to search or NULL of no free automata available
+ * @return automata ready to search or NULL of no free automata available,
+ * also while ac_remove_domain of the domain runs
  */
 void *ac_get_automata(void * domain_id);
 
@@ -106,6 +250,165 @@ void ac_put_automata(void * domain_id, void *automata);
  */
 int ac_search(void *automata, const void *data, unsigned len);
 
+/**
+ * ac_stream_init - init state of a new stream
+ * @stream - stream state
+ */
+void ac_stream_init(ac_stream *stream);
+
+/**
+ * ac_stream_resume - continue stream with automata lease
+ * @automata - automata id, leased on any cpu
+ * @stream - stream state saved by ac_stream_save or new one
+ *
+ * call it before the first search of the lease. match offsets of the lease
+ * are stream offsets then. if domain automata was rebuilt since the state
+ * was saved, the search starts from the initial state at the stream offset:
+ * matches started before are lost.
+ *
+ * @return -1 on error, 0 on success, 1 if the stream is restarted
+ */
+int ac_stream_resume(void *automata, const ac_stream *stream);
+
+/**
+ * ac_stream_save - save stream state of automata lease
+ * @automata - automata id
+ * @stream - stream state for ac_stream_resume
+ *
+ * @return -1 on error, 0 on success
+ */
+int ac_stream_save(void *automata, ac_stream *stream);
+
+/**
+ * ac_searchv - search data segments as one stream
+ *
+ * @automata - automata id
+ * @iov - data segments (struct kvec in kernel, struct iovec in userspace)
+ * @iovcnt - number of segments
+ *
+ * same as ac_search of each segment in turn, matches across segment bounds
+ * are found, match offsets are from the start of automata lease.
+ *
+ * @return -1 on error, 0 on success
+ */
+int ac_searchv(void *automata, const ac_iovec *iov, unsigned iovcnt);
+
+/**
+ * ac_search_batch - ac_search of several leases at once
+ * @automatas - distinct leased automatas, each one searches its own data
+ * @data - data of each automata
+ * @len - length of each data
+ * @num - number of automatas
+ *
+ * leases of one automata (e.g. of a domain without rebuild in between) in
+ * AC_MODE_ALL are searched interleaved, so cache misses of many short
+ * inputs overlap. other leases are searched one by one.
+ *
+ * @return -1 on error (nothing is searched), 0 on success
+ */
+int ac_search_batch(void *automatas[], const void *data[], const unsigned len[], unsigned num);
+
+#ifdef __KERNEL__
+/**
+ * ac_search_skb - search data of socket buffer in place
+ *
+ * @automata - automata id
+ * @skb - socket buffer, may be non-linear
+ * @offset - offset of data to search from skb->data
+ * @len - length of data in bytes
+ *
+ * paged and fragment list data is read with skb_seq_read(), skb is not
+ * linearized.
+ *
+ * @return -1 on error, 0 on success
+ */
+int ac_search_skb(void *automata, const struct sk_buff *skb, unsigned offset, unsigned len);
+#endif
+
+/**
+ * ac_match_mode - set match semantics of automata lease
+ * @automata - automata id
+ * @mode - AC_MODE_* mode
+ *
+ * a lease starts with AC_MODE_ALL, the mode is set before the first search.
+ * AC_MODE_LEFTMOST_LONGEST chooses a match when no longer match can start
+ * at or before it, but not later than the end of ac_search data: a match
+ * that could go on in the next data of the stream is reported as it is.
+ * ac_search_first always checks all matches.
+ *
+ * @return 0 on success, -1 on error
+ */
+int ac_match_mode(void *automata, unsigned mode);
+
+/**
+ * ac_search_first - check whether data has any pattern of bundle
+ *
+ * @automata - automata id
+ * @data - pointer to available data
+ * @len length of data in bytes
+ * @patterns - patterns bundle
+ *
+ * search stops at the first pattern of bundle, matches are not stored.
+ * after a pattern is found the automata state is undefined, as after
+ * stopped ac_search_cb. see also ac_patterns_tag.
+ *
+ * @return -1 on error, 0 if no pattern of bundle found, 1 if found
+ */
+int ac_search_first(void *automata, const void *data, unsigned len, ac_patterns *patterns);
+
+/**
+ * ac_match_cb - ac_search_cb match callback
+ * @pattern - matched pattern of bundle, NULL if search is not limited by bundle
+ * @num - matched pattern number in domain
+ * @end - offset after the match end from the start of automata lease
+ * @param - ac_search_cb param
+ *
+ * @return 0 to continue search, non 0 to stop it
+ */
+typedef int (*ac_match_cb)(ac_pattern *pattern, int num, unsigned long end, void *param);
+
+/**
+ * ac_search_cb - search data calling callback on each match
+ *
+ * @automata - automata id
+ * @data - pointer to available data
+ * @len length of data in bytes
+ * @patterns - report only patterns of this bundle, NULL for all patterns
+ * @cb - callback called from the scan loop
+ * @param - callback param
+ *
+ * matches are not stored: ac_next_match does not return them. after the
+ * callback stopped the search the automata state is undefined, further
+ * ac_search calls of the same lease do not continue the stream.
+ *
+ * @return -1 on error, 0 if data searched to the end, 1 if callback stopped search
+ */
+int ac_search_cb(void *automata, const void *data, unsigned len, ac_patterns *patterns, ac_match_cb cb, void *param);
+
+#ifndef __KERNEL__
+/**
+ * ac_search_parallel - search one large buffer with several threads
+ * @domain_id - pointer to domain
+ * @data, @len - buffer
+ * @threads - number of threads including the calling one, it is reduced
+ *   for short buffers
+ * @mode - AC_MODE_ALL or AC_MODE_LONGEST, see ac_match_mode
+ * @patterns, @cb, @param - see ac_search_cb, end is offset from @data
+ *
+ * the buffer is split into @threads chunks, each chunk is searched from
+ * the longest pattern length - 1 bytes before its start and keeps matches
+ * ending in it, so boundary matches are reported once. matches are
+ * reported by the calling thread after all chunks are searched, in the
+ * order of ac_search_cb over the whole buffer. no automata is leased, the
+ * search uses the automata current at the call and counts as a lease for
+ * ac_remove_domain until it returns.
+ *
+ * @return < 0 on error, 0 if all matches are reported, 1 if callback
+ *   stopped reporting
+ */
+int ac_search_parallel(void *domain_id, const void *data, unsigned long len, unsigned threads, unsigned mode, ac_patterns *patterns, ac_match_cb cb, void *param);
+#endif
+
 /**
  * ac_next_match - returns next matched ac_pattern in pattern of automata
  *
@@ -123,6 +426,37 @@ int ac_search(void *automata, const void *data, unsigned len);
  */
 ac_pattern* ac_next_match(void **patt_match, void *automata, ac_patterns *patterns);
 
+/**
+ * ac_match_start - offset of the match returned by ac_next_match
+ * @patt_match - match pointer updated by the last ac_next_match call
+ * @automata - automata id
+ *
+ * offsets are from the start of automata lease, so they stay valid across
+ * ac_search calls of a stream. with AC_DOMAIN_MATCH_BITSET it is the first
+ * match of the pattern.
+ *
+ * @return offset of the first matched byte, -1 if it is unknown
+ */
+long ac_match_start(void *patt_match, void *automata);
+
+/**
+ * ac_match_end - offset after the last byte of the match, see ac_match_start
+ * @patt_match - match pointer updated by the last ac_next_match call
+ * @automata - automata id
+ *
+ * @return offset after the match end, -1 if it is unknown
+ */
+long ac_match_end(void *patt_match, void *automata);
+
+/**
+ * ac_patterns_matched - check whether any pattern of bundle matched
+ * @automata - automata id
+ * @patterns - patterns bundle
+ *
+ * @return 1 if ac_next_match would return a pattern, 0 otherwise
+ */
+int ac_patterns_matched(void *automata, ac_patterns *patterns);
+
 /**
  * ac_pattern_str - get character string from pattern str
  * @pattern - ac_pattern returned by ac_next_match
@@ -131,9 +465,29 @@ ac_pattern* ac_next_match(void **patt_match, void *automata, ac_patterns *patter
  */
 const char * ac_pattern_str(ac_pattern *pattern);
 
+/**
+ * ac_match_overflow - number of matches dropped since automata lease
+ * @automata - automata id
+ *
+ * automata keeps first AC_MATCH_BUFFER_SIZE matches of the lease, ac_search
+ * does not allocate memory. matches found after that are not returned by
+ * ac_next_match, only counted here.
+ *
+ * @return number of dropped matches
+ */
+unsigned ac_match_overflow(void *automata);
+
 inline void *ac_malloc(size_t sz);
 inline void *ac_malloc_atomic(size_t sz);
 inline void *ac_zmalloc(size_t sz);
 inline void *ac_zmalloc_atomic(size_t sz);
 inline void ac_free(void *ptr);
+void *ac_vmalloc(size_t sz);
+void ac_vfree(void *ptr);
+/**
+ * ac_meminfo - print memory used by module and by each domain
+ *
+ * domain memory is split into trie nodes, trie edges, compiled table,
+ * patterns and automatas with their match buffers
+ */
 void ac_meminfo(void);
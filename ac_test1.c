@@ -56,7 +56,7 @@ static int __init ac_test_init_module( void )
 	int urls_num = sizeof(urls_str)/sizeof(char*);
 
 	ac_meminfo();
-	urls = ac_add_domain("ac_test1", 1, 2050, 1);
+	urls = ac_add_domain("ac_test1", 1, 2050, AC_DOMAIN_IGNORECASE);
 	if(!urls) {
 		PRINT("error adding domain\n");
 		return -1;
@@ -24,6 +24,8 @@ MODULE_AUTHOR("Ilya Gavrilov <gilyav@gmail.com>");
 
 void *urls;
 ac_patterns pt1;
+void *urls_compiled;
+ac_patterns pt2;
 
 static void ac_test_cleanup_module( void )
 {
@@ -31,24 +33,49 @@ static void ac_test_cleanup_module( void )
 		ac_remove_patterns(urls, &pt1);
 		ac_remove_domain(urls);
 	}
+	if(urls_compiled) {
+		ac_remove_patterns(urls_compiled, &pt2);
+		ac_remove_domain(urls_compiled);
+	}
 	ac_meminfo();
 }
 
-#ifndef __KERNEL__
-int main()
-#else
-static int __init ac_test_init_module( void )
-#endif
+static int ac_test_search(void *domain, ac_patterns *patterns)
 {
 	int i,j;
 	void *automata;
 	ac_pattern* patt;
 	void* match;
 
+    for(j = 0; j < 2 ; j++)
+		for(i = 0; i < urls_array_num; i++) {
+
+			automata = ac_get_automata(domain);
+			if(!automata) {
+				PRINT("Can't get_automata");
+				return -1;
+			}
+			ac_search(automata, urls_array[i], 79);
+
+			match = 0;
+			while( (patt=ac_next_match(&match, automata, patterns)) )
+				PRINT("found matched host: %s\n", ac_pattern_str(patt));
+
+			ac_put_automata(domain, automata);
+		}
+	return 0;
+}
+
+#ifndef __KERNEL__
+int main()
+#else
+static int __init ac_test_init_module( void )
+#endif
+{
 	int search_num = 1000;
 
 	ac_meminfo();
-	urls = ac_add_domain("ac_test2", 1, 2020, 1);
+	urls = ac_add_domain("ac_test2", 1, 2020, AC_DOMAIN_IGNORECASE);
 	if(!urls) {
 		PRINT("error adding domain\n");
 		return -1;
@@ -64,24 +91,30 @@ static int __init ac_test_init_module( void )
 	ac_meminfo();
 
 	PRINT("search %d patterns...\n", search_num);
-    for(j = 0; j < 2 ; j++)
-		for(i = 0; i < urls_array_num; i++) {
+	if(ac_test_search(urls, &pt1))
+		return -1;
+	PRINT("search %d patterns done\n", search_num);
 
-			automata = ac_get_automata(urls);
-			if(!automata) {
-				PRINT("Can't get_automata");
-				return -1;
-			}
-			ac_search(automata, urls_array[i], 79);
+	/* the same search with compiled transition table */
+	urls_compiled = ac_add_domain("ac_test2_compiled", 1, 2020, AC_DOMAIN_IGNORECASE | AC_DOMAIN_COMPILED);
+	if(!urls_compiled) {
+		PRINT("error adding domain\n");
+		return -1;
+	}
 
-			match = 0;
-			while( (patt=ac_next_match(&match, automata, &pt1)) )
-				PRINT("found matched host: %s\n", ac_pattern_str(patt));
+	ac_patterns_init(&pt2);
 
-			ac_put_automata(urls, automata);
-		}
+	ac_add_patterns(urls_compiled, sites2000, sites2000_num, &pt2);
+#ifdef __KERNEL__
+	mdelay(100);schedule();
+#endif
+	DEBUG("added patterns\n");
+	ac_meminfo();
 
-	PRINT("search %d patterns done\n", search_num);
+	PRINT("search %d patterns in compiled table...\n", search_num);
+	if(ac_test_search(urls_compiled, &pt2))
+		return -1;
+	PRINT("search %d patterns in compiled table done\n", search_num);
 
 #ifndef __KERNEL__
 	ac_test_cleanup_module();
@@ -0,0 +1,825 @@
+/*
+ * userspace test of search entry points: each one is checked against the
+ * matches of plain ac_search of the same data
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#define PRINT(x...) printf(x)
+
+#include "ac_module.h"
+
+#define TEST_SOURCE_LEN		4096
+#define TEST_PATTERNS		400
+#define TEST_PATTERN_LEN	10
+#define TEST_TEXTS		64
+#define TEST_TEXT_LEN		80
+#define TEST_AUTOMATAS		(TEST_TEXTS + 2)
+#define TEST_THREADS		4
+#define TEST_CHANGES		200
+#define TEST_BIG_LEN		(1024*1024)
+#define TEST_BENCH_ROUNDS	16
+
+/* patterns and texts are pieces of one random source, so they overlap */
+static char source[TEST_SOURCE_LEN];
+static char pattern_buf[TEST_PATTERNS][TEST_PATTERN_LEN + 1];
+static const char *patterns[TEST_PATTERNS];
+static unsigned patterns_num;
+static char texts[TEST_TEXTS][TEST_TEXT_LEN];
+static char *big;
+
+struct hit {
+	unsigned long end;
+	const char *str;
+};
+
+/* first matches in order and a hash of all of them */
+struct hits {
+	struct hit hit[AC_MATCH_BUFFER_SIZE];
+	unsigned num;
+	unsigned long sum;
+};
+
+static void hits_add(struct hits *h, unsigned long end, const char *str)
+{
+	if(h->num < AC_MATCH_BUFFER_SIZE) {
+		h->hit[h->num].end = end;
+		h->hit[h->num].str = str;
+	}
+	h->num++;
+	h->sum = h->sum * 31 + end;
+	for(; *str; str++)
+		h->sum = h->sum * 31 + *str;
+}
+
+/* number of matches kept in hit */
+static unsigned hits_stored(struct hits *h)
+{
+	return h->num < AC_MATCH_BUFFER_SIZE ? h->num : AC_MATCH_BUFFER_SIZE;
+}
+
+static int hits_equal(struct hits *h1, struct hits *h2)
+{
+	return h1->num == h2->num && h1->sum == h2->sum;
+}
+
+static int hits_cb(ac_pattern *pattern, int num, unsigned long end, void *param)
+{
+	(void)num;
+	hits_add((struct hits *)param, end, ac_pattern_str(pattern));
+	return 0;
+}
+
+/* matches of bundle stored by automata lease */
+static void hits_collect(struct hits *h, void *automata, ac_patterns *bundle)
+{
+	ac_pattern *patt;
+	void *match = 0;
+
+	memset(h, 0, sizeof(*h));
+	while( (patt=ac_next_match(&match, automata, bundle)) )
+		hits_add(h, ac_match_end(match, automata), ac_pattern_str(patt));
+}
+
+/* reference: plain ac_search of the whole data */
+static int hits_search(struct hits *h, void *domain, ac_patterns *bundle, const void *data, unsigned len)
+{
+	void *automata;
+	int ret;
+
+	automata = ac_get_automata(domain);
+	if(!automata)
+		return -1;
+	ret = ac_search(automata, data, len);
+	hits_collect(h, automata, bundle);
+	if(ac_match_overflow(automata))
+		ret = -1;
+	ac_put_automata(domain, automata);
+	return ret;
+}
+
+static void test_data_init(void)
+{
+	unsigned i, j, off, len;
+
+	srand(1);
+	for(i = 0; i < TEST_SOURCE_LEN; i++)
+		source[i] = "abcdefgh"[rand() % 8];
+	for(i = 0; i < TEST_PATTERNS; i++) {
+		len = 3 + rand() % (TEST_PATTERN_LEN - 2);
+		off = rand() % (TEST_SOURCE_LEN - len);
+		memcpy(pattern_buf[i], source + off, len);
+		pattern_buf[i][len] = 0;
+		for(j = 0; j < patterns_num; j++)
+			if(strcmp(patterns[j], pattern_buf[i]) == 0)
+				break;
+		if(j == patterns_num)
+			patterns[patterns_num++] = pattern_buf[i];
+	}
+	for(i = 0; i < TEST_TEXTS; i++) {
+		memcpy(texts[i], source + rand() % (TEST_SOURCE_LEN - TEST_TEXT_LEN), TEST_TEXT_LEN);
+		texts[i][rand() % TEST_TEXT_LEN] = 'x';
+	}
+	big = malloc(TEST_BIG_LEN);
+	if(!big)
+		return;
+	for(i = 0; i < TEST_BIG_LEN; i += len) {
+		len = TEST_BIG_LEN - i < TEST_TEXT_LEN ? TEST_BIG_LEN - i : TEST_TEXT_LEN;
+		memcpy(big + i, texts[rand() % TEST_TEXTS], len);
+	}
+}
+
+/* domain with all patterns in bundle, searched after the rebuild */
+static void *test_domain(const char *name, unsigned flags, ac_patterns *bundle)
+{
+	void *domain;
+
+	domain = ac_add_domain(name, TEST_AUTOMATAS, 2 * TEST_PATTERNS, flags);
+	if(!domain)
+		return NULL;
+	ac_patterns_init(bundle);
+	if(ac_add_patterns(domain, patterns, patterns_num, bundle)) {
+		ac_remove_domain(domain);
+		return NULL;
+	}
+	ac_flush_domain(domain);
+	return domain;
+}
+
+static void test_domain_remove(void *domain, ac_patterns *bundle)
+{
+	ac_remove_patterns(domain, bundle);
+	ac_flush_domain(domain);
+	ac_remove_domain(domain);
+}
+
+static int test_search_cb(void *domain, ac_patterns *bundle)
+{
+	struct hits h1, h2;
+	void *automata;
+	int i, bad = 0;
+
+	for(i = 0; i < TEST_TEXTS; i++) {
+		bad += hits_search(&h1, domain, bundle, texts[i], TEST_TEXT_LEN) != 0;
+		memset(&h2, 0, sizeof(h2));
+		automata = ac_get_automata(domain);
+		bad += ac_search_cb(automata, texts[i], TEST_TEXT_LEN, bundle, hits_cb, &h2) != 0;
+		ac_put_automata(domain, automata);
+		bad += !hits_equal(&h1, &h2);
+	}
+	return bad;
+}
+
+/* each chunk with other lease, so the state moves between cursors */
+static int test_stream(void *domain, ac_patterns *bundle)
+{
+	struct hits h1, h2, chunk;
+	ac_stream stream;
+	void *automata;
+	void *other;
+	unsigned s0, s1, k;
+	int i, c, bad = 0;
+
+	for(i = 0; i < TEST_TEXTS; i++) {
+		bad += hits_search(&h1, domain, bundle, texts[i], TEST_TEXT_LEN) != 0;
+		memset(&h2, 0, sizeof(h2));
+		ac_stream_init(&stream);
+		for(c = 0; c < 5; c++) {
+			s0 = TEST_TEXT_LEN * c / 5;
+			s1 = TEST_TEXT_LEN * (c + 1) / 5;
+			other = ac_get_automata(domain);
+			automata = ac_get_automata(domain);
+			bad += ac_stream_resume(automata, &stream) != 0;
+			ac_search(automata, texts[i] + s0, s1 - s0);
+			hits_collect(&chunk, automata, bundle);
+			bad += chunk.num > AC_MATCH_BUFFER_SIZE;
+			for(k = 0; k < hits_stored(&chunk); k++)
+				hits_add(&h2, chunk.hit[k].end, chunk.hit[k].str);
+			bad += ac_stream_save(automata, &stream) != 0;
+			ac_put_automata(domain, automata);
+			ac_put_automata(domain, other);
+		}
+		bad += !hits_equal(&h1, &h2);
+	}
+	return bad;
+}
+
+static int test_searchv(void *domain, ac_patterns *bundle)
+{
+	struct hits h1, h2;
+	ac_iovec iov[4];
+	void *automata;
+	int i, bad = 0;
+
+	for(i = 0; i < TEST_TEXTS; i++) {
+		bad += hits_search(&h1, domain, bundle, texts[i], TEST_TEXT_LEN) != 0;
+		iov[0].iov_base = texts[i];
+		iov[0].iov_len = i % TEST_TEXT_LEN;
+		iov[1].iov_base = texts[i] + iov[0].iov_len;
+		iov[1].iov_len = 0;
+		iov[2].iov_base = texts[i] + iov[0].iov_len;
+		iov[2].iov_len = 1;
+		iov[3].iov_base = texts[i] + iov[0].iov_len + 1;
+		iov[3].iov_len = TEST_TEXT_LEN - iov[0].iov_len - 1;
+		automata = ac_get_automata(domain);
+		bad += ac_searchv(automata, iov, 4) != 0;
+		hits_collect(&h2, automata, bundle);
+		ac_put_automata(domain, automata);
+		bad += !hits_equal(&h1, &h2);
+	}
+	return bad;
+}
+
+static int test_search_batch(void *domain, ac_patterns *bundle)
+{
+	struct hits h1, h2;
+	void *automatas[TEST_TEXTS];
+	const void *data[TEST_TEXTS];
+	unsigned len[TEST_TEXTS];
+	int i, bad = 0;
+
+	for(i = 0; i < TEST_TEXTS; i++) {
+		automatas[i] = ac_get_automata(domain);
+		if(!automatas[i]) {
+			while(i--)
+				ac_put_automata(domain, automatas[i]);
+			return 1;
+		}
+		data[i] = texts[i];
+		len[i] = TEST_TEXT_LEN - i % 7;
+	}
+	bad += ac_search_batch(automatas, data, len, TEST_TEXTS) != 0;
+	for(i = 0; i < TEST_TEXTS; i++) {
+		hits_collect(&h2, automatas[i], bundle);
+		ac_put_automata(domain, automatas[i]);
+		bad += hits_search(&h1, domain, bundle, data[i], len[i]) != 0;
+		bad += !hits_equal(&h1, &h2);
+	}
+	return bad;
+}
+
+/* the longest match at each end of stored matches, ends are ascending */
+static void hits_longest(struct hits *longest, struct hits *h)
+{
+	unsigned i, j, best, num = hits_stored(h);
+
+	memset(longest, 0, sizeof(*longest));
+	for(i = 0; i < num; i = j) {
+		best = i;
+		for(j = i + 1; j < num && h->hit[j].end == h->hit[i].end; j++)
+			if(strlen(h->hit[j].str) > strlen(h->hit[best].str))
+				best = j;
+		hits_add(longest, h->hit[best].end, h->hit[best].str);
+	}
+}
+
+/* non-overlapping leftmost longest matches of stored matches */
+static void hits_leftmost_longest(struct hits *leftmost, struct hits *h)
+{
+	unsigned long pos = 0, start, best_start;
+	unsigned i, best, num = hits_stored(h);
+
+	memset(leftmost, 0, sizeof(*leftmost));
+	for(;;) {
+		best = num;
+		best_start = 0;
+		for(i = 0; i < num; i++) {
+			start = h->hit[i].end - strlen(h->hit[i].str);
+			if(start < pos)
+				continue;
+			if(best == num || start < best_start ||
+				(start == best_start && h->hit[i].end > h->hit[best].end)) {
+				best = i;
+				best_start = start;
+			}
+		}
+		if(best == num)
+			break;
+		hits_add(leftmost, h->hit[best].end, h->hit[best].str);
+		pos = h->hit[best].end;
+	}
+}
+
+static int test_match_mode(void *domain, ac_patterns *bundle)
+{
+	struct hits h1, expected, h2;
+	void *automata;
+	unsigned mode;
+	int i, bad = 0;
+
+	for(i = 0; i < TEST_TEXTS; i++) {
+		bad += hits_search(&h1, domain, bundle, texts[i], TEST_TEXT_LEN) != 0;
+		for(mode = AC_MODE_ALL; mode <= AC_MODE_LEFTMOST_LONGEST; mode++) {
+			if(mode == AC_MODE_ALL)
+				expected = h1;
+			else if(mode == AC_MODE_LONGEST)
+				hits_longest(&expected, &h1);
+			else
+				hits_leftmost_longest(&expected, &h1);
+			automata = ac_get_automata(domain);
+			bad += ac_match_mode(automata, mode) != 0;
+			ac_search(automata, texts[i], TEST_TEXT_LEN);
+			hits_collect(&h2, automata, bundle);
+			ac_put_automata(domain, automata);
+			bad += !hits_equal(&expected, &h2);
+		}
+	}
+	return bad;
+}
+
+static int test_count_cb(ac_pattern *pattern, int num, unsigned long end, void *param)
+{
+	(void)pattern;
+	(void)num;
+	(void)end;
+	(*(unsigned long *)param)++;
+	return 0;
+}
+
+static double test_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* throughput of ac_search_parallel by number of threads */
+static void bench_search_parallel(void *domain, ac_patterns *bundle, unsigned flags)
+{
+	unsigned long count;
+	unsigned threads, i;
+	double start, time;
+
+	for(threads = 1; threads <= TEST_THREADS; threads++) {
+		count = 0;
+		start = test_time();
+		for(i = 0; i < TEST_BENCH_ROUNDS; i++)
+			ac_search_parallel(domain, big, TEST_BIG_LEN, threads, AC_MODE_ALL, bundle, test_count_cb, &count);
+		time = test_time() - start;
+		PRINT("ac_search_parallel (flags %u) threads %u: %.0f MB/s\n", flags, threads,
+			TEST_BENCH_ROUNDS * (TEST_BIG_LEN / 1e6) / time);
+	}
+}
+
+static int test_search_parallel(void *domain, ac_patterns *bundle)
+{
+	struct hits h1, h2;
+	void *automata;
+	unsigned mode;
+	int bad = 0;
+
+	if(!big)
+		return 1;
+	for(mode = AC_MODE_ALL; mode <= AC_MODE_LONGEST; mode++) {
+		memset(&h1, 0, sizeof(h1));
+		automata = ac_get_automata(domain);
+		ac_match_mode(automata, mode);
+		bad += ac_search_cb(automata, big, TEST_BIG_LEN, bundle, hits_cb, &h1) != 0;
+		ac_put_automata(domain, automata);
+		memset(&h2, 0, sizeof(h2));
+		bad += ac_search_parallel(domain, big, TEST_BIG_LEN, TEST_THREADS, mode, bundle, hits_cb, &h2) != 0;
+		bad += !hits_equal(&h1, &h2) || h1.num == 0;
+	}
+	return bad;
+}
+
+/* ac_search_first of tagged and untagged bundles */
+static int test_search_first(void *domain)
+{
+	ac_patterns bundles[4];
+	struct hits h;
+	void *automata;
+	unsigned num;
+	int i, k, found, bad = 0;
+
+	for(k = 0; k < 4; k++) {
+		ac_patterns_init(&bundles[k]);
+		num = patterns_num / 4;
+		bad += ac_add_patterns(domain, patterns + k * num, num, &bundles[k]) != 0;
+	}
+	bad += ac_patterns_tag(domain, &bundles[1]) != 0;
+	bad += ac_patterns_tag(domain, &bundles[3]) != 0;
+	ac_flush_domain(domain);
+	for(i = 0; i < TEST_TEXTS; i++)
+		for(k = 0; k < 4; k++) {
+			automata = ac_get_automata(domain);
+			ac_search(automata, texts[i], TEST_TEXT_LEN);
+			hits_collect(&h, automata, &bundles[k]);
+			found = ac_patterns_matched(automata, &bundles[k]);
+			ac_put_automata(domain, automata);
+			bad += found != (h.num != 0);
+			automata = ac_get_automata(domain);
+			bad += ac_search_first(automata, texts[i], TEST_TEXT_LEN, &bundles[k]) != found;
+			ac_put_automata(domain, automata);
+		}
+	for(k = 0; k < 4; k++)
+		ac_remove_patterns(domain, &bundles[k]);
+	ac_flush_domain(domain);
+	return bad;
+}
+
+/* bitset reports every matched pattern once */
+static int test_match_bitset(void *domain, ac_patterns *bundle, unsigned flags)
+{
+	struct hits h1, h2;
+	ac_patterns bits_bundle;
+	void *bits;
+	unsigned j, k, distinct;
+	int i, bad = 0;
+
+	bits = test_domain("ac_test3_bits", flags | AC_DOMAIN_MATCH_BITSET, &bits_bundle);
+	if(!bits)
+		return 1;
+	for(i = 0; i < TEST_TEXTS; i++) {
+		bad += hits_search(&h1, domain, bundle, texts[i], TEST_TEXT_LEN) != 0;
+		bad += hits_search(&h2, bits, &bits_bundle, texts[i], TEST_TEXT_LEN) != 0;
+		distinct = 0;
+		for(j = 0; j < hits_stored(&h1); j++) {
+			for(k = 0; k < j; k++)
+				if(strcmp(h1.hit[j].str, h1.hit[k].str) == 0)
+					break;
+			distinct += k == j;
+		}
+		bad += h2.num != distinct;
+		for(k = 0; k < hits_stored(&h2); k++) {
+			for(j = 0; j < hits_stored(&h1); j++)
+				if(strcmp(h1.hit[j].str, h2.hit[k].str) == 0)
+					break;
+			bad += j == hits_stored(&h1);
+		}
+	}
+	test_domain_remove(bits, &bits_bundle);
+	return bad;
+}
+
+static int test_loaded(void *domain, ac_patterns *bundle, void *loaded)
+{
+	ac_patterns loaded_bundle;
+	struct hits h1, h2;
+	int i, bad = 0;
+
+	if(!loaded)
+		return 1;
+	ac_patterns_init(&loaded_bundle);
+	bad += ac_add_patterns(loaded, patterns, patterns_num, &loaded_bundle) != 0;
+	ac_flush_domain(loaded);
+	for(i = 0; i < TEST_TEXTS; i++) {
+		bad += hits_search(&h1, domain, bundle, texts[i], TEST_TEXT_LEN) != 0;
+		bad += hits_search(&h2, loaded, &loaded_bundle, texts[i], TEST_TEXT_LEN) != 0;
+		bad += !hits_equal(&h1, &h2);
+	}
+	test_domain_remove(loaded, &loaded_bundle);
+	return bad;
+}
+
+/* image of compiled domain, in memory and in file */
+static int test_image(void *domain, ac_patterns *bundle)
+{
+	char path[] = "/tmp/ac_test3.XXXXXX";
+	void *image;
+	long size;
+	int fd, bad = 0;
+
+	size = ac_save_domain(domain, NULL, 0);
+	if(size <= 0)
+		return 1;
+	image = malloc(size);
+	if(!image)
+		return 1;
+	bad += ac_save_domain(domain, image, size) != size;
+	bad += ac_save_domain(domain, image, size - 1) != -ENOSPC;
+	bad += test_loaded(domain, bundle, ac_load_domain("ac_test3_image", image, size, TEST_AUTOMATAS, TEST_PATTERNS));
+	free(image);
+
+	fd = mkstemp(path);
+	if(fd < 0)
+		return bad + 1;
+	close(fd);
+	bad += ac_save_domain_file(domain, path) != 0;
+	bad += test_loaded(domain, bundle, ac_load_domain_file("ac_test3_file", path, TEST_AUTOMATAS, TEST_PATTERNS));
+	unlink(path);
+	return bad;
+}
+
+/* a pattern of two bundles is matched for both, and stays for the other */
+static int test_shared_pattern(void)
+{
+	const char *patts1[] = {"ab", "abab", "b"};
+	const char *patts2[] = {"ab", "ab"};
+	ac_patterns bundle1, bundle2;
+	struct hits h1, h2;
+	void *domain;
+	int bad = 0;
+
+	domain = ac_add_domain("ac_test3_shared", 1, 4, 0);
+	if(!domain)
+		return 1;
+	ac_patterns_init(&bundle1);
+	ac_patterns_init(&bundle2);
+	bad += ac_add_patterns(domain, patts1, 3, &bundle1) != 0;
+	/* 3 patterns of 4 are used, the same strings take no new one */
+	bad += ac_add_patterns(domain, patts2, 2, &bundle2) != 0;
+	ac_flush_domain(domain);
+	bad += hits_search(&h1, domain, &bundle1, "xxababxx", 8) != 0;
+	bad += hits_search(&h2, domain, &bundle2, "xxababxx", 8) != 0;
+	bad += h1.num != 5 || h2.num != 2;
+
+	ac_remove_patterns(domain, &bundle2);
+	ac_flush_domain(domain);
+	bad += hits_search(&h2, domain, &bundle1, "xxababxx", 8) != 0;
+	bad += !hits_equal(&h1, &h2);
+	test_domain_remove(domain, &bundle1);
+	return bad;
+}
+
+/* matches after AC_MATCH_BUFFER_SIZE are counted, not stored */
+static int test_match_overflow(void)
+{
+	const char *patts[] = {"ab", "abab", "b"};
+	char text[200];
+	ac_patterns bundle;
+	struct hits h;
+	void *automata;
+	void *domain;
+	unsigned i;
+	int bad = 0;
+
+	for(i = 0; i < sizeof(text); i++)
+		text[i] = "ab"[i % 2];
+	domain = ac_add_domain("ac_test3_overflow", 1, 4, 0);
+	if(!domain)
+		return 1;
+	ac_patterns_init(&bundle);
+	bad += ac_add_patterns(domain, patts, 3, &bundle) != 0;
+	ac_flush_domain(domain);
+	automata = ac_get_automata(domain);
+	bad += ac_search(automata, text, sizeof(text)) != 0;
+	hits_collect(&h, automata, &bundle);
+	/* 100 "ab", 99 "abab" and 100 "b" */
+	bad += h.num != AC_MATCH_BUFFER_SIZE || h.num + ac_match_overflow(automata) != 299;
+	ac_put_automata(domain, automata);
+	test_domain_remove(domain, &bundle);
+	return bad;
+}
+
+/* start and end of each match point at the pattern in data */
+static int test_match_offsets(void *domain, ac_patterns *bundle)
+{
+	ac_pattern *patt;
+	void *automata;
+	void *match;
+	long start, end;
+	int i, bad = 0;
+
+	for(i = 0; i < TEST_TEXTS; i++) {
+		automata = ac_get_automata(domain);
+		/* offsets are from the start of lease, across searches */
+		ac_search(automata, texts[i], TEST_TEXT_LEN / 2);
+		ac_search(automata, texts[i] + TEST_TEXT_LEN / 2, TEST_TEXT_LEN - TEST_TEXT_LEN / 2);
+		match = 0;
+		while( (patt=ac_next_match(&match, automata, bundle)) ) {
+			start = ac_match_start(match, automata);
+			end = ac_match_end(match, automata);
+			bad += start < 0 || end > TEST_TEXT_LEN || (size_t)(end - start) != strlen(ac_pattern_str(patt));
+			bad += start >= 0 && memcmp(texts[i] + start, ac_pattern_str(patt), end - start) != 0;
+		}
+		ac_put_automata(domain, automata);
+	}
+	return bad;
+}
+
+/* automatas_number leases, busy domain while leased, reuse after put */
+static int test_lease(void)
+{
+	void *automatas[3];
+	void *domain;
+	int bad = 0;
+
+	domain = ac_add_domain("ac_test3_lease", 2, 4, 0);
+	if(!domain)
+		return 1;
+	automatas[0] = ac_get_automata(domain);
+	automatas[1] = ac_get_automata(domain);
+	automatas[2] = ac_get_automata(domain);
+	bad += !automatas[0] || !automatas[1] || automatas[2];
+	bad += ac_remove_domain(domain) == 0;
+	ac_put_automata(domain, automatas[1]);
+	automatas[2] = ac_get_automata(domain);
+	bad += automatas[2] != automatas[1];
+	ac_put_automata(domain, automatas[2]);
+	ac_put_automata(domain, automatas[0]);
+	bad += ac_remove_domain(domain) != 0;
+	return bad;
+}
+
+struct test_slot {
+	pthread_t thread;
+	void *domain;
+	pthread_barrier_t *barrier;
+	unsigned leased;
+};
+
+/* threads started in turn get slots in turn, each one empties its own pool */
+static void *test_slot_thread(void *param)
+{
+	struct test_slot *slot = param;
+	void *automatas[TEST_AUTOMATAS + 1];
+	unsigned i;
+
+	for(i = 0; i <= TEST_AUTOMATAS; i++) {
+		automatas[i] = ac_get_automata(slot->domain);
+		if(!automatas[i])
+			break;
+	}
+	slot->leased = i;
+	pthread_barrier_wait(slot->barrier);
+	while(i--)
+		ac_put_automata(slot->domain, automatas[i]);
+	return NULL;
+}
+
+static int test_slots(void)
+{
+	struct test_slot slots[TEST_THREADS];
+	pthread_barrier_t barrier;
+	void *domain;
+	unsigned i;
+	int bad = 0;
+
+	domain = ac_add_domain("ac_test3_slots", TEST_AUTOMATAS, 4, 0);
+	if(!domain)
+		return 1;
+	pthread_barrier_init(&barrier, NULL, TEST_THREADS);
+	for(i = 0; i < TEST_THREADS; i++) {
+		slots[i].domain = domain;
+		slots[i].barrier = &barrier;
+		if(pthread_create(&slots[i].thread, NULL, test_slot_thread, &slots[i]))
+			return 1;
+	}
+	for(i = 0; i < TEST_THREADS; i++) {
+		pthread_join(slots[i].thread, NULL);
+		bad += slots[i].leased != TEST_AUTOMATAS;
+	}
+	pthread_barrier_destroy(&barrier);
+	bad += ac_remove_domain(domain) != 0;
+	return bad;
+}
+
+struct test_worker {
+	pthread_t thread;
+	void *domain;
+	ac_patterns *bundle;
+	struct hits *expected;
+	int *stop;
+	unsigned searches;
+	int bad;
+};
+
+/* matches of the stable bundle don't change while other bundles do */
+static void *test_worker_thread(void *param)
+{
+	struct test_worker *worker = param;
+	struct hits h;
+	int i;
+
+	do {
+		for(i = 0; i < TEST_TEXTS; i++) {
+			worker->bad += hits_search(&h, worker->domain, worker->bundle, texts[i], TEST_TEXT_LEN) != 0;
+			worker->bad += !hits_equal(&h, &worker->expected[i]);
+			worker->searches++;
+		}
+	} while(!__atomic_load_n(worker->stop, __ATOMIC_RELAXED));
+	return NULL;
+}
+
+/* searches of several threads race pattern changes and rebuilds */
+static int test_threads(void *domain, ac_patterns *bundle)
+{
+	static char other_buf[TEST_PATTERNS][TEST_PATTERN_LEN + 2];
+	const char *other[TEST_PATTERNS];
+	struct test_worker workers[TEST_THREADS];
+	struct hits expected[TEST_TEXTS];
+	ac_patterns changed;
+	unsigned i, num;
+	int stop = 0, bad = 0;
+
+	/* strings of the stable bundle and strings never found */
+	num = patterns_num / 2;
+	for(i = 0; i < num; i++) {
+		if(i % 2) {
+			other[i] = patterns[i];
+			continue;
+		}
+		snprintf(other_buf[i], sizeof(other_buf[i]), "y%s", patterns[i]);
+		other[i] = other_buf[i];
+	}
+	for(i = 0; i < TEST_TEXTS; i++)
+		bad += hits_search(&expected[i], domain, bundle, texts[i], TEST_TEXT_LEN) != 0;
+	for(i = 0; i < TEST_THREADS; i++) {
+		workers[i].domain = domain;
+		workers[i].bundle = bundle;
+		workers[i].expected = expected;
+		workers[i].stop = &stop;
+		workers[i].searches = 0;
+		workers[i].bad = 0;
+		if(pthread_create(&workers[i].thread, NULL, test_worker_thread, &workers[i]))
+			return bad + 1;
+	}
+	for(i = 0; i < TEST_CHANGES; i++) {
+		ac_patterns_init(&changed);
+		bad += ac_add_patterns(domain, other, num, &changed) != 0;
+		if(i % 2)
+			ac_flush_domain(domain);
+		bad += ac_remove_patterns(domain, &changed) != 0;
+	}
+	ac_flush_domain(domain);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for(i = 0; i < TEST_THREADS; i++) {
+		pthread_join(workers[i].thread, NULL);
+		bad += workers[i].bad || !workers[i].searches;
+	}
+	return bad;
+}
+
+/* ascii case folding covers 'A' and 'Z' too */
+static int test_ignorecase(unsigned flags)
+{
+	const char *patts[] = {"a", "z", "azimuth", "pizza", "zebra"};
+	const char *lower = "azimuth zebra pizza za";
+	const char *upper = "AZIMUTH ZEBRA PIZZA ZA";
+	ac_patterns bundle;
+	struct hits h1, h2;
+	void *domain;
+	int bad = 0;
+
+	domain = ac_add_domain("ac_test3_case", 1, 8, flags | AC_DOMAIN_IGNORECASE);
+	if(!domain)
+		return 1;
+	ac_patterns_init(&bundle);
+	bad += ac_add_patterns(domain, patts, 5, &bundle) != 0;
+	ac_flush_domain(domain);
+	bad += hits_search(&h1, domain, &bundle, lower, strlen(lower)) != 0;
+	bad += hits_search(&h2, domain, &bundle, upper, strlen(upper)) != 0;
+	bad += !hits_equal(&h1, &h2) || h1.num != 12;
+	test_domain_remove(domain, &bundle);
+	return bad;
+}
+
+static int report(const char *test, unsigned flags, int bad)
+{
+	PRINT("%s (flags %u): %s\n", test, flags, bad ? "FAILED" : "ok");
+	return bad != 0;
+}
+
+int main()
+{
+	unsigned flags[] = {0, AC_DOMAIN_COMPILED, AC_DOMAIN_COMPILED | AC_DOMAIN_IGNORECASE};
+	ac_patterns bundle;
+	void *domain;
+	unsigned i;
+	int failed = 0;
+
+	/* rebuilds run in domain threads, concurrently with searches */
+	if(ac_init_threads(TEST_THREADS, AC_THREADS_REBUILD)) {
+		PRINT("error init threads\n");
+		return 1;
+	}
+	test_data_init();
+	for(i = 0; i < sizeof(flags)/sizeof(flags[0]); i++) {
+		domain = test_domain("ac_test3", flags[i], &bundle);
+		if(!domain) {
+			PRINT("error adding domain\n");
+			return 1;
+		}
+		failed += report("ac_search_cb", flags[i], test_search_cb(domain, &bundle));
+		failed += report("ac_stream", flags[i], test_stream(domain, &bundle));
+		failed += report("ac_searchv", flags[i], test_searchv(domain, &bundle));
+		failed += report("ac_search_batch", flags[i], test_search_batch(domain, &bundle));
+		failed += report("ac_match_start", flags[i], test_match_offsets(domain, &bundle));
+		failed += report("ac_match_mode", flags[i], test_match_mode(domain, &bundle));
+		failed += report("ac_search_parallel", flags[i], test_search_parallel(domain, &bundle));
+		if(big)
+			bench_search_parallel(domain, &bundle, flags[i]);
+		failed += report("ac_search_first", flags[i], test_search_first(domain));
+		failed += report("AC_DOMAIN_MATCH_BITSET", flags[i], test_match_bitset(domain, &bundle, flags[i]));
+		failed += report("threads", flags[i], test_threads(domain, &bundle));
+		if(flags[i] & AC_DOMAIN_COMPILED)
+			failed += report("ac_save_domain", flags[i], test_image(domain, &bundle));
+		test_domain_remove(domain, &bundle);
+	}
+	failed += report("shared pattern", 0, test_shared_pattern());
+	failed += report("ac_match_overflow", 0, test_match_overflow());
+	failed += report("ac_get_automata", 0, test_lease());
+	failed += report("per cpu pools", 0, test_slots());
+	failed += report("AC_DOMAIN_IGNORECASE", 0, test_ignorecase(0));
+	failed += report("AC_DOMAIN_IGNORECASE", AC_DOMAIN_COMPILED, test_ignorecase(AC_DOMAIN_COMPILED));
+	free(big);
+	ac_meminfo();
+	PRINT("%s\n", failed ? "FAILED" : "all ok");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,705 @@
+/*
+ * actable.c: implementation of compiled (table driven) automata
+ * This file is part of modified multifast.
+ *
+    Copyright 2015 Ilya Gavrilov <gilyav@gmail.com>
+
+    multifast is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    multifast is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with multifast.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __KERNEL__
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#ifdef __KERNEL__
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/prefetch.h>
+#define AC_ERROR(x...) printk(x)
+#define AC_PRINT(x...) printk(x)
+#define AC_PREFETCH(x) prefetch(x)
+#else
+#define AC_ERROR(x...) printf(x)
+#define AC_PRINT(x...) printf(x)
+#define AC_PREFETCH(x) __builtin_prefetch(x)
+#endif
+
+#include "node.h"
+#include "ahocorasick.h"
+#include "actable.h"
+#include "ac_module.h"
+
+/* Alignment of the arrays inside of the table allocation */
+#define AC_TABLE_ALIGN(x) (((x) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+
+/* Private function prototype */
+static unsigned int ac_table_classify
+    (AC_AUTOMATA_t * automata, AC_NODE_t ** nodes, unsigned int nodes_num,
+     unsigned char * classmap);
+
+
+/******************************************************************************
+ * FUNCTION: ac_table_classify
+ * Build the byte to equivalence class map. every byte used on some edge gets
+ * its own class, all other bytes can't be distinguished by any node and
+ * collapse into class 0. with case unsensitive automata upper case letters
+ * get the class of the lower case letter (the same folding as
+ * ac_automata_search() does). returns number of classes.
+******************************************************************************/
+static unsigned int ac_table_classify
+    (AC_AUTOMATA_t * automata, AC_NODE_t ** nodes, unsigned int nodes_num,
+     unsigned char * classmap)
+{
+    unsigned int i, j, c;
+    unsigned int classes_num = 0;
+    unsigned char used[AC_TABLE_ALPHABET];
+    AC_NODE_t * n;
+
+    memset(used, 0, AC_TABLE_ALPHABET);
+    for (i = 0; i < nodes_num; i++)
+    {
+        n = nodes[i];
+        for (j = 0; j < n->outgoing_degree; j++)
+            used[(unsigned char)n->outgoing[j].alpha] = 1;
+    }
+    for (c = 0; c < AC_TABLE_ALPHABET; c++)
+        classes_num += used[c];
+
+    /* Class 0 is kept for unused bytes unless every byte is used */
+    j = (classes_num < AC_TABLE_ALPHABET);
+    for (c = 0; c < AC_TABLE_ALPHABET; c++)
+        classmap[c] = used[c] ? j++ : 0;
+    classes_num = j;
+
+    if (automata->ignorecase)
+        for (c = 65; c <= 90; c++)
+            classmap[c] = classmap[c + 32];
+
+    return classes_num;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_compile
+ * Build the transition table from the finalized automata. all_nodes of the
+ * finalized automata are in BFS order, so the failure node of every node
+ * gets its row before the node itself and the row can be inherited from it.
+ * PARAMS:
+ * AC_AUTOMATA_t * automata: finalized automata
+ * RETURN VALUE:
+ * compiled table or NULL on error
+******************************************************************************/
+AC_TABLE_t * ac_table_compile (AC_AUTOMATA_t * automata)
+{
+    AC_TABLE_t * thiz;
+    AC_NODE_t ** nodes = automata->all_nodes;
+    AC_NODE_t * n;
+    unsigned int * row;
+    unsigned int * trans;
+    struct ac_table_state * states;
+    AC_PATTERN_t * patterns;
+    unsigned int nodes_num = automata->all_nodes_num;
+    unsigned int i, s;
+    unsigned int classes_num;
+    unsigned int patterns_num = 0;
+    unsigned char classmap[AC_TABLE_ALPHABET];
+    unsigned long trans_off, states_off, patterns_off, strings_off, size;
+    unsigned long strings_size = 0;
+    char * str;
+
+    if (automata->automata_open || !nodes)
+        return NULL;
+
+    for (s = 0; s < nodes_num; s++)
+    {
+        n = nodes[s];
+        patterns_num += n->matched_patterns_num;
+        for (i = 0; i < n->matched_patterns_num; i++)
+            strings_size += n->matched_patterns[i].length + 1;
+    }
+
+    classes_num = ac_table_classify(automata, nodes, nodes_num, classmap);
+
+    trans_off = AC_TABLE_ALIGN(sizeof(AC_TABLE_t));
+    states_off = AC_TABLE_ALIGN(trans_off +
+            (unsigned long)nodes_num * classes_num * sizeof(unsigned int));
+    patterns_off = AC_TABLE_ALIGN(states_off +
+            (unsigned long)nodes_num * sizeof(struct ac_table_state));
+    strings_off = patterns_off + (unsigned long)patterns_num * sizeof(AC_PATTERN_t);
+    size = AC_TABLE_ALIGN(strings_off + strings_size);
+
+    thiz = (AC_TABLE_t *) ac_vmalloc (size);
+    if (!thiz)
+    {
+        AC_ERROR("ac_table_compile: can't allocate %lu bytes\n", size);
+        return NULL;
+    }
+    memset(thiz, 0, sizeof(AC_TABLE_t));
+    thiz->magic = AC_TABLE_MAGIC;
+    thiz->version = AC_TABLE_VERSION;
+    thiz->word_size = sizeof(long);
+    thiz->flags = automata->ignorecase ? AC_TABLE_IGNORECASE : 0;
+    thiz->states_num = nodes_num;
+    thiz->classes_num = classes_num;
+    memcpy(thiz->classmap, classmap, AC_TABLE_ALPHABET);
+    thiz->patterns_num = patterns_num;
+    thiz->size = size;
+    thiz->trans_off = trans_off;
+    thiz->states_off = states_off;
+    thiz->patterns_off = patterns_off;
+    thiz->strings_off = strings_off;
+    thiz->strings_size = size - strings_off;
+    trans = AC_TABLE_TRANS(thiz);
+    states = AC_TABLE_STATES(thiz);
+    patterns = AC_TABLE_PATTERNS(thiz);
+    str = (char *)thiz + strings_off;
+    memset(str, 0, thiz->strings_size);
+
+    patterns_num = 0;
+    for (s = 0; s < nodes_num; s++)
+    {
+        n = nodes[s];
+        row = &trans[s * classes_num];
+
+        /* Missing transitions are the ones of the failure node */
+        if (n->failure_node)
+            memcpy(row, &trans[n->failure_node->state * classes_num],
+                    classes_num * sizeof(unsigned int));
+        else
+            memset(row, 0, classes_num * sizeof(unsigned int));
+
+        for (i = 0; i < n->outgoing_degree; i++)
+            row[classmap[(unsigned char)n->outgoing[i].alpha]] =
+                n->outgoing[i].next->state;
+
+        states[s].match_first = patterns_num;
+        states[s].match_num = n->matched_patterns_num;
+        states[s].output = n->output_node ? n->output_node->state : 0;
+        states[s].depth = n->depth;
+        states[s].mask = n->mask;
+        for (i = 0; i < n->matched_patterns_num; i++)
+        {
+            patterns[patterns_num] = n->matched_patterns[i];
+            memcpy(str, n->matched_patterns[i].astring,
+                    n->matched_patterns[i].length);
+            patterns[patterns_num++].astring = str;
+            str += n->matched_patterns[i].length + 1;
+        }
+    }
+
+    return thiz;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_search
+ * Table driven version of ac_automata_search(). see ac_automata_search() for
+ * the return values.
+ * PARAMS:
+ * AC_TABLE_t * thiz: the pointer to the compiled table
+ * AC_CURSOR_t * cursor: search state, updated on return
+ * AC_TEXT_t * text: the input text that must be searched
+ * AC_MATCH_CALBACK_f callback: call-back function for matches
+ * void * param: this parameter will be send to call-back function
+******************************************************************************/
+int ac_table_search (AC_TABLE_t * thiz, AC_CURSOR_t * cursor, AC_TEXT_t * text,
+        AC_MATCH_CALBACK_f callback, void * param)
+{
+    const unsigned char * astring = (const unsigned char *) text->astring;
+    const unsigned int * trans = AC_TABLE_TRANS(thiz);
+    const struct ac_table_state * states = AC_TABLE_STATES(thiz);
+    AC_PATTERN_t * patterns = AC_TABLE_PATTERNS(thiz);
+    const unsigned char * classmap = thiz->classmap;
+    const unsigned int classes_num = thiz->classes_num;
+    const struct ac_table_state * st;
+    unsigned long position;
+    unsigned int s = cursor->current_state;
+    unsigned int o;
+    AC_MATCH_t match;
+
+    /* This is the main search loop.
+     * it must be as lightweight as possible. */
+    for (position = 0; position < text->length; position++)
+    {
+        s = trans[s * classes_num + classmap[astring[position]]];
+        st = &states[s];
+        if (st->match_num | st->output)
+        {
+            match.position = position + 1 + cursor->base_position;
+            /* report the state and every final state on its output chain */
+            o = st->match_num ? s : st->output;
+            do {
+                st = &states[o];
+                match.match_num = st->match_num;
+                match.patterns = &patterns[st->match_first];
+                /* we found a match! do call-back */
+                if (callback(&match, param))
+                    return 1;
+            } while ((o = st->output));
+        }
+    }
+
+    /* save status variables */
+    cursor->current_state = s;
+    cursor->base_position += position;
+    return 0;
+}
+
+/* Text searched by ac_table_search_batch() */
+struct ac_table_lane
+{
+    const unsigned char * astring;
+    unsigned long length;
+    unsigned long position;
+    unsigned int state;
+    unsigned int text; /* Index of the text in the batch */
+};
+
+/******************************************************************************
+ * FUNCTION: ac_table_search_batch
+ * Searches several independent texts, each one as ac_table_search() with its
+ * own cursor and call-back param. up to AC_TABLE_BATCH texts are advanced by
+ * one byte in turn and the next transition of each is prefetched, so the
+ * cache misses of the texts overlap. a finished text is replaced by the next
+ * one. matches of a text are reported in its order, matches of different
+ * texts are interleaved.
+ * PARAMS:
+ * AC_TABLE_t * thiz: the pointer to the compiled table
+ * AC_CURSOR_t ** cursors: search states of texts, updated on return
+ * AC_TEXT_t * texts: the input texts
+ * unsigned int num: number of texts
+ * AC_MATCH_CALBACK_f callback: call-back function for matches
+ * void ** params: call-back params of texts
+ * RETURN VALUE:
+ * number of texts whose search was stopped by the call-back, the cursor of
+ * a stopped text is not updated
+******************************************************************************/
+int ac_table_search_batch (AC_TABLE_t * thiz, AC_CURSOR_t ** cursors,
+        AC_TEXT_t * texts, unsigned int num, AC_MATCH_CALBACK_f callback,
+        void ** params)
+{
+    const unsigned int * trans = AC_TABLE_TRANS(thiz);
+    const struct ac_table_state * states = AC_TABLE_STATES(thiz);
+    AC_PATTERN_t * patterns = AC_TABLE_PATTERNS(thiz);
+    const unsigned char * classmap = thiz->classmap;
+    const unsigned int classes_num = thiz->classes_num;
+    const struct ac_table_state * st;
+    struct ac_table_lane lanes[AC_TABLE_BATCH];
+    struct ac_table_lane * l;
+    unsigned int active = 0, next = 0, stopped = 0;
+    unsigned int i, s, o;
+    int stop;
+    AC_MATCH_t match;
+
+    for (;;)
+    {
+        /* fill free lanes, empty texts are done at once */
+        while (active < AC_TABLE_BATCH && next < num)
+        {
+            if (!texts[next].length)
+            {
+                next++;
+                continue;
+            }
+            l = &lanes[active++];
+            l->astring = (const unsigned char *) texts[next].astring;
+            l->length = texts[next].length;
+            l->position = 0;
+            l->state = cursors[next]->current_state;
+            l->text = next++;
+        }
+        if (!active)
+            break;
+
+        for (i = 0; i < active; i++)
+        {
+            l = &lanes[i];
+            s = trans[l->state * classes_num + classmap[l->astring[l->position++]]];
+            l->state = s;
+            if (l->position < l->length)
+                AC_PREFETCH(&trans[s * classes_num +
+                        classmap[l->astring[l->position]]]);
+            st = &states[s];
+            stop = 0;
+            if (st->match_num | st->output)
+            {
+                match.position = l->position + cursors[l->text]->base_position;
+                o = st->match_num ? s : st->output;
+                do {
+                    st = &states[o];
+                    match.match_num = st->match_num;
+                    match.patterns = &patterns[st->match_first];
+                    if (callback(&match, params[l->text]))
+                    {
+                        stop = 1;
+                        break;
+                    }
+                } while ((o = st->output));
+            }
+            if (stop)
+                stopped++;
+            else if (l->position < l->length)
+                continue;
+            else
+            {
+                cursors[l->text]->current_state = s;
+                cursors[l->text]->base_position += l->length;
+            }
+            /* the text is done, the last lane takes its place */
+            *l = lanes[--active];
+            i--;
+        }
+    }
+    return stopped;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_search_mode
+ * Table driven search with AC_MATCH_LONGEST or AC_MATCH_LEFTMOST_LONGEST
+ * semantics of the cursor (see AC_MATCH_MODE_t). the call-back gets only
+ * the patterns of the longest final state of a position.
+ * see ac_table_search() for params and return values.
+******************************************************************************/
+int ac_table_search_mode (AC_TABLE_t * thiz, AC_CURSOR_t * cursor,
+        AC_TEXT_t * text, AC_MATCH_CALBACK_f callback, void * param)
+{
+    const unsigned char * astring = (const unsigned char *) text->astring;
+    const unsigned int * trans = AC_TABLE_TRANS(thiz);
+    const struct ac_table_state * states = AC_TABLE_STATES(thiz);
+    AC_PATTERN_t * patterns = AC_TABLE_PATTERNS(thiz);
+    const unsigned char * classmap = thiz->classmap;
+    const unsigned int classes_num = thiz->classes_num;
+    const struct ac_table_state * st;
+    unsigned long position = 0;
+    unsigned long end, start;
+    unsigned long pending_start = 0, pending_end = 0;
+    unsigned int pending = 0; /* final state of the chosen match, 0 if none */
+    unsigned int s = cursor->current_state;
+    unsigned int o;
+    AC_MATCH_t match;
+
+    for (;;)
+    {
+        while (position < text->length)
+        {
+            s = trans[s * classes_num + classmap[astring[position++]]];
+            st = &states[s];
+            end = position + cursor->base_position;
+
+            /* no match found later can start at or before the chosen one */
+            if (pending && end - st->depth > pending_start)
+                break;
+
+            if (!(st->match_num | st->output))
+                continue;
+            o = st->match_num ? s : st->output;
+            if (cursor->mode == AC_MATCH_LONGEST)
+            {
+                match.position = end;
+                match.match_num = states[o].match_num;
+                match.patterns = &patterns[states[o].match_first];
+                if (callback(&match, param))
+                    return 1;
+                continue;
+            }
+            /* the same start with a later end is longer */
+            start = end - states[o].depth;
+            if (!pending || start <= pending_start)
+            {
+                pending = o;
+                pending_start = start;
+                pending_end = end;
+            }
+        }
+
+        if (!pending)
+            break;
+        match.position = pending_end;
+        match.match_num = states[pending].match_num;
+        match.patterns = &patterns[states[pending].match_first];
+        if (callback(&match, param))
+            return 1;
+        /* the next match starts after this one: search again from its end */
+        s = 0;
+        position = pending_end - cursor->base_position;
+        pending = 0;
+    }
+
+    cursor->current_state = s;
+    cursor->base_position += position;
+    return 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_search_mask
+ * Table driven version of ac_automata_search_mask(): reports only states
+ * whose mask intersects the given mask.
+******************************************************************************/
+int ac_table_search_mask (AC_TABLE_t * thiz, AC_CURSOR_t * cursor,
+        AC_TEXT_t * text, unsigned long mask, AC_MATCH_CALBACK_f callback,
+        void * param)
+{
+    const unsigned char * astring = (const unsigned char *) text->astring;
+    const unsigned int * trans = AC_TABLE_TRANS(thiz);
+    const struct ac_table_state * states = AC_TABLE_STATES(thiz);
+    AC_PATTERN_t * patterns = AC_TABLE_PATTERNS(thiz);
+    const unsigned char * classmap = thiz->classmap;
+    const unsigned int classes_num = thiz->classes_num;
+    const struct ac_table_state * st;
+    unsigned long position;
+    unsigned int s = cursor->current_state;
+    unsigned int o;
+    AC_MATCH_t match;
+
+    for (position = 0; position < text->length; position++)
+    {
+        s = trans[s * classes_num + classmap[astring[position]]];
+        st = &states[s];
+        if (st->mask & mask)
+        {
+            match.position = position + 1 + cursor->base_position;
+            o = st->match_num ? s : st->output;
+            do {
+                st = &states[o];
+                match.match_num = st->match_num;
+                match.patterns = &patterns[st->match_first];
+                if (callback(&match, param))
+                    return 1;
+            } while ((o = st->output));
+        }
+    }
+
+    cursor->current_state = s;
+    cursor->base_position += position;
+    return 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_findnext
+ * Table driven version of ac_automata_findnext().
+ * PARAMS:
+ * AC_TABLE_t * thiz: the pointer to the compiled table
+ * AC_CURSOR_t * cursor: search state, updated on return
+ * AC_TEXT_t * text: the input text
+ * unsigned long * position: last searched position in the text
+ * unsigned int * output: next state of the output chain to report, 0 if none
+******************************************************************************/
+AC_MATCH_t * ac_table_findnext (AC_TABLE_t * thiz, AC_CURSOR_t * cursor,
+        AC_TEXT_t * text, unsigned long * position, unsigned int * output)
+{
+    const unsigned char * astring = (const unsigned char *) text->astring;
+    const unsigned int * trans = AC_TABLE_TRANS(thiz);
+    const struct ac_table_state * states = AC_TABLE_STATES(thiz);
+    AC_PATTERN_t * patterns = AC_TABLE_PATTERNS(thiz);
+    const struct ac_table_state * st;
+    unsigned long pos = *position;
+    unsigned int s = cursor->current_state;
+    static AC_MATCH_t match;
+
+    /* Finish the output chain of the previous match first */
+    if (*output)
+    {
+        st = &states[*output];
+        match.position = pos + cursor->base_position;
+        match.match_num = st->match_num;
+        match.patterns = &patterns[st->match_first];
+        *output = st->output;
+        return &match;
+    }
+
+    match.match_num = 0;
+
+    while (pos < text->length)
+    {
+        s = trans[s * thiz->classes_num + thiz->classmap[astring[pos++]]];
+        st = &states[s];
+        if (st->match_num | st->output)
+        {
+            if (!st->match_num)
+                st = &states[st->output];
+            match.position = pos + cursor->base_position;
+            match.match_num = st->match_num;
+            match.patterns = &patterns[st->match_first];
+            *output = st->output;
+            break;
+        }
+    }
+
+    cursor->current_state = s;
+    *position = pos;
+
+    if (!match.match_num)
+        cursor->base_position += pos;
+
+    return match.match_num?&match:0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_check
+ * Validate a table image before using it in place: the header must match
+ * this build and every array, state, transition and pattern string must be
+ * inside of the image, so a corrupted image can't make the search loop read
+ * outside of it. all the table is read once.
+ * PARAMS:
+ * const void * image: the table image, aligned to sizeof(long)
+ * unsigned long size: size of the image in bytes
+ * RETURN VALUE:
+ * 0 if the image is valid, -1 otherwise
+******************************************************************************/
+int ac_table_check (const void * image, unsigned long size)
+{
+    const AC_TABLE_t * thiz = (const AC_TABLE_t *) image;
+    const unsigned int * trans;
+    const struct ac_table_state * st;
+    const AC_PATTERN_t * patterns;
+    const char * str;
+    unsigned long i, n, len;
+
+    if (size < sizeof(AC_TABLE_t) || ((unsigned long)image & (sizeof(long) - 1)))
+        return -1;
+    if (thiz->magic != AC_TABLE_MAGIC || thiz->version != AC_TABLE_VERSION ||
+            thiz->word_size != sizeof(long) || thiz->size != size)
+        return -1;
+    if (!thiz->states_num || !thiz->classes_num ||
+            thiz->classes_num > AC_TABLE_ALPHABET)
+        return -1;
+
+    /* arrays are in order, aligned and don't overlap */
+    n = (unsigned long)thiz->states_num * thiz->classes_num;
+    if (thiz->trans_off < sizeof(AC_TABLE_t) ||
+            thiz->trans_off != AC_TABLE_ALIGN(thiz->trans_off) ||
+            thiz->trans_off > size || n / thiz->classes_num != thiz->states_num ||
+            n > (size - thiz->trans_off) / sizeof(unsigned int))
+        return -1;
+    if (thiz->states_off < thiz->trans_off + n * sizeof(unsigned int) ||
+            thiz->states_off != AC_TABLE_ALIGN(thiz->states_off) ||
+            thiz->states_off > size || thiz->states_num >
+            (size - thiz->states_off) / sizeof(struct ac_table_state))
+        return -1;
+    if (thiz->patterns_off < thiz->states_off +
+            thiz->states_num * sizeof(struct ac_table_state) ||
+            thiz->patterns_off != AC_TABLE_ALIGN(thiz->patterns_off) ||
+            thiz->patterns_off > size || thiz->patterns_num >
+            (size - thiz->patterns_off) / sizeof(AC_PATTERN_t))
+        return -1;
+    if (thiz->strings_off != thiz->patterns_off +
+            thiz->patterns_num * sizeof(AC_PATTERN_t) ||
+            thiz->strings_off > size ||
+            thiz->strings_size != size - thiz->strings_off)
+        return -1;
+
+
+    for (i = 0; i < AC_TABLE_ALPHABET; i++)
+        if (thiz->classmap[i] >= thiz->classes_num)
+            return -1;
+
+    trans = AC_TABLE_TRANS(thiz);
+    for (i = 0; i < n; i++)
+        if (trans[i] >= thiz->states_num)
+            return -1;
+
+    /* states are in BFS order: output links point to shallower states
+     * before the state, so the output chains of searches end */
+    st = AC_TABLE_STATES(thiz);
+    if (st[0].output || st[0].depth)
+        return -1;
+    for (i = 0; i < thiz->states_num; i++)
+        if (st[i].match_first > thiz->patterns_num ||
+                st[i].match_num > thiz->patterns_num - st[i].match_first ||
+                (i && st[i].output >= i) ||
+                st[i].depth > AC_PATTRN_MAX_LENGTH ||
+                (st[i].output && st[st[i].output].depth >= st[i].depth))
+            return -1;
+
+    /* pattern pointers are meaningless in images, strings follow patterns */
+    patterns = AC_TABLE_PATTERNS(thiz);
+    str = AC_TABLE_STRINGS(thiz);
+    len = thiz->strings_size;
+    for (i = 0; i < thiz->patterns_num; i++)
+    {
+        if (patterns[i].astring || patterns[i].length >= len ||
+                str[patterns[i].length])
+            return -1;
+        str += patterns[i].length + 1;
+        len -= patterns[i].length + 1;
+    }
+    return len < sizeof(long) ? 0 : -1;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_save
+ * Write the table image, it is a copy of the table with cleared pattern
+ * string pointers (the strings are inside of the table).
+ * PARAMS:
+ * AC_TABLE_t * thiz: the pointer to the compiled table
+ * void * image: output buffer, aligned to sizeof(long), thiz->size bytes
+ * unsigned long size: size of the output buffer
+ * RETURN VALUE:
+ * size of the image or 0 if the buffer is too small
+******************************************************************************/
+unsigned long ac_table_save (AC_TABLE_t * thiz, void * image, unsigned long size)
+{
+    AC_PATTERN_t * patterns;
+    unsigned int i;
+
+    if (size < thiz->size)
+        return 0;
+
+    memcpy(image, thiz, thiz->size);
+    patterns = AC_TABLE_PATTERNS((AC_TABLE_t *) image);
+    for (i = 0; i < thiz->patterns_num; i++)
+        patterns[i].astring = NULL;
+    return thiz->size;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_release
+ * Release the compiled table
+******************************************************************************/
+void ac_table_release (AC_TABLE_t * thiz)
+{
+    ac_vfree(thiz);
+}
+
+/******************************************************************************
+ * FUNCTION: ac_table_display
+ * Prints the compiled table summary and accepted patterns of every state.
+******************************************************************************/
+void ac_table_display (AC_TABLE_t * thiz)
+{
+    unsigned int s, j;
+    struct ac_table_state * states = AC_TABLE_STATES(thiz);
+    AC_PATTERN_t * patterns = AC_TABLE_PATTERNS(thiz);
+    struct ac_table_state * st;
+
+    AC_PRINT("---------------------------------\n");
+    AC_PRINT("TABLE: states: %u classes: %u patterns: %u size: %lu\n",
+            thiz->states_num, thiz->classes_num, thiz->patterns_num, thiz->size);
+    for (s = 0; s < thiz->states_num; s++)
+    {
+        st = &states[s];
+        if (!st->match_num)
+            continue;
+        AC_PRINT("STATE(%3u)/---output--> STATE(%3u) accepted patterns: {",
+                s, st->output);
+        for (j = 0; j < st->match_num; j++)
+        {
+            if(j) AC_PRINT(", ");
+            AC_PRINT("%ld", patterns[st->match_first + j].rep.number);
+        }
+        AC_PRINT("}\n");
+    }
+    AC_PRINT("---------------------------------\n");
+}
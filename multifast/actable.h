@@ -0,0 +1,135 @@
+/*
+ * actable.h: compiled (table driven) automata header file
+ * This file is part of modified multifast.
+ *
+    Copyright 2015 Ilya Gavrilov <gilyav@gmail.com>
+
+    multifast is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    multifast is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with multifast.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _ACTABLE_H_
+#define _ACTABLE_H_
+
+#include "actypes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct AC_AUTOMATA;
+struct AC_CURSOR;
+
+/* Number of byte values mapped by AC_TABLE_t.classmap */
+#define AC_TABLE_ALPHABET 256
+
+/* Image header identification, see AC_TABLE_t */
+#define AC_TABLE_MAGIC 0x42544341 /* "ACTB" in little endian */
+#define AC_TABLE_VERSION 3
+
+/* Number of texts advanced together by batch searches */
+#define AC_TABLE_BATCH 8
+
+/* AC_TABLE_t.flags */
+#define AC_TABLE_IGNORECASE 0x01
+
+/* Compiled automata state */
+struct ac_table_state
+{
+    unsigned int match_first; /* Index of the first own accepted pattern */
+    unsigned int match_num; /* Number of own accepted patterns */
+    unsigned int output; /* Nearest final state on the failure chain,
+                          * 0 if none (the root is never final) */
+    unsigned int depth; /* AC_NODE_t.depth of the state */
+    unsigned long mask; /* AC_NODE_t.mask of the state */
+};
+
+/* AC_TABLE_t:
+ * Compiled form of a finalized automata. nodes are renumbered in BFS order
+ * (the root is state 0) and every transition, including the ones resolved
+ * through failure links, is stored in 'trans', so the search loop does
+ * exactly one table lookup per input byte. the table and all its arrays
+ * live in one contiguous allocation.
+ * input bytes are mapped into equivalence classes by 'classmap' before the
+ * lookup: bytes that do not appear in any pattern share class 0 and with
+ * case unsensitive search upper case letters share the class of their lower
+ * case letter, so a row has only 'classes_num' columns.
+ * the arrays are addressed by offsets from the table start and the pattern
+ * strings are stored after the patterns as NUL terminated strings in
+ * 'patterns' order, so the table memory is also its serialized image: it is
+ * saved by ac_table_save() and can be used in place from any address (e.g.
+ * a mmaped file) after ac_table_check(). the only pointers, 'astring' of
+ * patterns, are NULL in images. the image is native endian and word size
+ * dependent, 'magic' and 'word_size' reject foreign images.
+**/
+typedef struct AC_TABLE
+{
+    unsigned int magic; /* AC_TABLE_MAGIC */
+    unsigned short version; /* AC_TABLE_VERSION */
+    unsigned char word_size; /* sizeof(long) of the builder */
+    unsigned char flags; /* AC_TABLE_* */
+
+    unsigned int states_num; /* Number of states */
+    unsigned int classes_num; /* Number of byte classes (row width) */
+    unsigned int patterns_num; /* Number of entries in 'patterns' */
+    unsigned long size; /* Size of the whole table in bytes */
+
+    /* offsets from the table start */
+    unsigned long trans_off; /* states_num rows of classes_num next states */
+    unsigned long states_off; /* Per state accepted patterns */
+    unsigned long patterns_off; /* Own accepted patterns of all states */
+    unsigned long strings_off; /* Pattern strings */
+    unsigned long strings_size; /* Up to the end of the table */
+
+    unsigned char classmap[AC_TABLE_ALPHABET]; /* Byte to class map */
+} AC_TABLE_t;
+
+#define AC_TABLE_TRANS(t) \
+    ((unsigned int *)((char *)(t) + (t)->trans_off))
+#define AC_TABLE_STATES(t) \
+    ((struct ac_table_state *)((char *)(t) + (t)->states_off))
+#define AC_TABLE_PATTERNS(t) \
+    ((AC_PATTERN_t *)((char *)(t) + (t)->patterns_off))
+#define AC_TABLE_STRINGS(t) \
+    ((const char *)(t) + (t)->strings_off)
+
+
+AC_TABLE_t * ac_table_compile  (struct AC_AUTOMATA * automata);
+int          ac_table_check    (const void * image, unsigned long size);
+unsigned long ac_table_save    (AC_TABLE_t * thiz, void * image,
+                                unsigned long size);
+int          ac_table_search   (AC_TABLE_t * thiz, struct AC_CURSOR * cursor,
+                                AC_TEXT_t * text, AC_MATCH_CALBACK_f callback,
+                                void * param);
+AC_MATCH_t * ac_table_findnext (AC_TABLE_t * thiz, struct AC_CURSOR * cursor,
+                                AC_TEXT_t * text, unsigned long * position,
+                                unsigned int * output);
+int          ac_table_search_batch (AC_TABLE_t * thiz,
+                                struct AC_CURSOR ** cursors, AC_TEXT_t * texts,
+                                unsigned int num, AC_MATCH_CALBACK_f callback,
+                                void ** params);
+int          ac_table_search_mode (AC_TABLE_t * thiz,
+                                struct AC_CURSOR * cursor, AC_TEXT_t * text,
+                                AC_MATCH_CALBACK_f callback, void * param);
+int          ac_table_search_mask (AC_TABLE_t * thiz,
+                                struct AC_CURSOR * cursor, AC_TEXT_t * text,
+                                unsigned long mask,
+                                AC_MATCH_CALBACK_f callback, void * param);
+void         ac_table_release  (AC_TABLE_t * thiz);
+void         ac_table_display  (AC_TABLE_t * thiz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
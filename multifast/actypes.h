@@ -95,6 +95,9 @@ typedef struct AC_TEXT
  * position 40 in the text, then the start position of them are 34 and 36
  * respectively. finally the field 'match_num' maintains the number of
  * matched patterns.
+ * the patterns of a node do not include the patterns of its failure chain,
+ * so when several final nodes end at the same position the call-back is
+ * called once per node, starting from the longest patterns.
 **/
 typedef struct AC_MATCH
 {
@@ -103,6 +106,23 @@ typedef struct AC_MATCH
     unsigned int match_num; /* Number of matched patterns */
 } AC_MATCH_t;
 
+/* AC_MATCH_MODE_t:
+ * Match semantics of a search cursor (AC_CURSOR_t.mode).
+ * AC_MATCH_ALL reports every pattern at every end position, overlapping
+ * ones too. AC_MATCH_LONGEST reports only the longest patterns ending at a
+ * position. AC_MATCH_LEFTMOST_LONGEST reports non-overlapping matches: the
+ * one starting first, the longest of them, then the search goes on after
+ * its end. a match is chosen when no longer one can start at or before its
+ * start, but not later than the end of the chunk: a match that could be
+ * extended into the next chunk is reported as it is.
+**/
+typedef enum AC_MATCH_MODE
+{
+    AC_MATCH_ALL = 0,
+    AC_MATCH_LONGEST,
+    AC_MATCH_LEFTMOST_LONGEST
+} AC_MATCH_MODE_t;
+
 /* AC_STATUS_t:
  * Return status of an AC function
 **/
@@ -115,7 +135,7 @@ typedef enum AC_STATUS
     ACERR_AUTOMATA_CLOSED,      /* Automata is closed. after calling
                                  * ac_automata_finalize() you can not add new 
                                  * patterns to the automata. */
-	ACERR_NUMBER_TOO_BIG        /* number nodes exceeded */
+	ACERR_NUMBER_TOO_BIG        /* can't allocate memory for nodes */
 } AC_STATUS_t;
 
 /* AC_MATCH_CALBACK_t:
@@ -132,6 +152,13 @@ typedef enum AC_STATUS
 **/
 typedef int (*AC_MATCH_CALBACK_f)(AC_MATCH_t *, void *);
 
+/* AC_PATTERN_MASK_f:
+ * Returns the mask of a pattern for ac_automata_mask(). the meaning of the
+ * mask bits is up to the caller, e.g. groups of patterns. the second
+ * parameter is the one given to ac_automata_mask().
+**/
+typedef unsigned long (*AC_PATTERN_MASK_f)(AC_PATTERN_t *, void *);
+
 /* AC_PATTRN_MAX_LENGTH:
  * Maximum acceptable pattern length in AC_PATTERN_t.length
 **/
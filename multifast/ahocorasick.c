@@ -28,40 +28,44 @@
 #ifdef __KERNEL__
 #include <linux/slab.h>
 #include <linux/ctype.h>
+#include <linux/prefetch.h>
 #define AC_ERROR(x...) printk(x)
 #define AC_PRINT(x...) printk(x)
 #define AC_DEBUG(x...) {printf("ahokorasick debug: ");printf(x);}
+#define AC_PREFETCH(x) prefetch(x)
 
 #else
 
 #define AC_ERROR(x...) printf(x)
 #define AC_PRINT(x...) printf(x)
 #define AC_DEBUG(x...) {printk("ahokorasick debug: ");printf(x);}
+#define AC_PREFETCH(x) __builtin_prefetch(x)
 
 #endif
 
 #include "node.h"
+#include "mpool.h"
 #include "ahocorasick.h"
+#include "actable.h"
 #include "ac_module.h"
 
 #define malloc(x) ac_malloc(x)
 #define free(x) ac_free(x)
 
-/* Allocation step for automata.all_nodes */
-#ifndef REALLOC_CHUNK_ALLNODES
-#define REALLOC_CHUNK_ALLNODES 200
-#endif
-
 /* Private function prototype */
-static void ac_automata_register_nodeptr
-    (AC_AUTOMATA_t * thiz, AC_NODE_t * node);
-static void ac_automata_union_matchstrs
-    (AC_NODE_t * node);
-static void ac_automata_set_failure
-    (AC_AUTOMATA_t * thiz, AC_NODE_t * node, AC_ALPHABET_t * alphas);
-static void ac_automata_traverse_setfailure
-    (AC_AUTOMATA_t * thiz, AC_NODE_t * node, AC_ALPHABET_t * alphas);
+static int ac_automata_bfs_setfailure
+    (AC_AUTOMATA_t * thiz);
 static void ac_automata_reset (AC_AUTOMATA_t * thiz);
+static void ac_automata_release_nodes (AC_AUTOMATA_t * thiz);
+static int ac_automata_search_nodes (AC_AUTOMATA_t * thiz,
+        AC_CURSOR_t * cursor, AC_TEXT_t * text, const unsigned long * mask,
+        AC_MATCH_CALBACK_f callback, void * param);
+static int ac_automata_search_nodes_mode (AC_AUTOMATA_t * thiz,
+        AC_CURSOR_t * cursor, AC_TEXT_t * text,
+        AC_MATCH_CALBACK_f callback, void * param);
+static int ac_automata_search_nodes_batch (AC_AUTOMATA_t * thiz,
+        AC_CURSOR_t ** cursors, AC_TEXT_t * texts, unsigned int num,
+        AC_MATCH_CALBACK_f callback, void ** params);
 
 
 /******************************************************************************
@@ -73,11 +77,18 @@ static void ac_automata_reset (AC_AUTOMATA_t * thiz);
 AC_AUTOMATA_t * ac_automata_init (int ignorecase)
 {
     AC_AUTOMATA_t * thiz = (AC_AUTOMATA_t *)malloc(sizeof(AC_AUTOMATA_t));
+    if (!thiz)
+        return NULL;
     memset (thiz, 0, sizeof(AC_AUTOMATA_t));
-    thiz->root = node_create ();
-    thiz->all_nodes_max = REALLOC_CHUNK_ALLNODES;
-    thiz->all_nodes = (AC_NODE_t **) malloc (thiz->all_nodes_max*sizeof(AC_NODE_t *));
-    ac_automata_register_nodeptr (thiz, thiz->root);
+    thiz->pool = mpool_create (0);
+    if (thiz->pool)
+        thiz->root = node_create (thiz->pool);
+    if (!thiz->root)
+    {
+        ac_automata_release (thiz);
+        return NULL;
+    }
+    thiz->all_nodes_num = 1;
     ac_automata_reset (thiz);
     thiz->total_patterns = 0;
     thiz->automata_open = 1;
@@ -87,7 +98,8 @@ AC_AUTOMATA_t * ac_automata_init (int ignorecase)
 
 /******************************************************************************
  * FUNCTION: ac_automata_add
- * Adds pattern to the automata.
+ * Adds pattern to the automata. the pattern string is copied, the caller
+ * can release it after the call.
  * PARAMS:
  * AC_AUTOMATA_t * thiz: the pointer to the automata
  * AC_PATTERN_t * patt: the pointer to added pattern
@@ -100,6 +112,8 @@ AC_STATUS_t ac_automata_add (AC_AUTOMATA_t * thiz, AC_PATTERN_t * patt)
     AC_NODE_t * n = thiz->root;
     AC_NODE_t * next;
     AC_ALPHABET_t alpha;
+    AC_ALPHABET_t * astring;
+    AC_PATTERN_t pattern;
 
     if(!thiz->automata_open)
         return ACERR_AUTOMATA_CLOSED;
@@ -113,7 +127,7 @@ AC_STATUS_t ac_automata_add (AC_AUTOMATA_t * thiz, AC_PATTERN_t * patt)
     for (i=0; i<patt->length; i++)
     {
         alpha = patt->astring[i];
-	if(thiz->ignorecase && alpha>65 && alpha<90)
+	if(thiz->ignorecase && alpha>=65 && alpha<=90)
 		alpha += 32;
         if ((next = node_find_next(n, alpha)))
         {
@@ -122,49 +136,136 @@ AC_STATUS_t ac_automata_add (AC_AUTOMATA_t * thiz, AC_PATTERN_t * patt)
         }
         else
         {
-            next = node_create_next(n, alpha);
+            next = node_create_next(n, alpha, thiz->pool);
+            if (!next)
+                return ACERR_NUMBER_TOO_BIG;
             next->depth = n->depth + 1;
             n = next;
-    	    if(thiz->all_nodes_num >= thiz->all_nodes_max)
-		    return ACERR_NUMBER_TOO_BIG;
-            ac_automata_register_nodeptr(thiz, n);
+            thiz->all_nodes_num++;
         }
     }
 
     if(n->final)
         return ACERR_DUPLICATE_PATTERN;
 
+    /* The automata keeps its own copy of the pattern string */
+    astring = (AC_ALPHABET_t *) mpool_malloc(thiz->pool, patt->length + 1);
+    if (!astring)
+        return ACERR_NUMBER_TOO_BIG;
+    memcpy(astring, patt->astring, patt->length);
+    astring[patt->length] = 0;
+    pattern = *patt;
+    pattern.astring = astring;
+
+    if (node_register_matchstr(n, &pattern, thiz->pool))
+        return ACERR_NUMBER_TOO_BIG;
     n->final = 1;
-    node_register_matchstr(n, patt);
     thiz->total_patterns++;
+    if (patt->length > thiz->max_length)
+        thiz->max_length = patt->length;
 
     return ACERR_SUCCESS;
 }
 
 /******************************************************************************
  * FUNCTION: ac_automata_finalize
- * Locate the failure node for all nodes and collect all matched pattern for
- * every node. it also sorts outgoing edges of node, so binary search could be
+ * Locate the failure node and the output node (nearest final node on the
+ * failure chain) for all nodes. it also sorts outgoing edges of node and
+ * chooses node representation sized to its fan-out, so fast search could be
  * performed on them. after calling this function the automate literally will
  * be finalized and you can not add new patterns to the automate.
  * PARAMS:
  * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * RETURN VALUE:
+ * 0: success
+ * -1: failed to allocate the BFS queue, the automata stays open and
+ * searches fail
 ******************************************************************************/
-void ac_automata_finalize (AC_AUTOMATA_t * thiz)
+int ac_automata_finalize (AC_AUTOMATA_t * thiz)
 {
     unsigned int i;
-    AC_ALPHABET_t alphas[AC_PATTRN_MAX_LENGTH];
     AC_NODE_t * node;
 
-    ac_automata_traverse_setfailure (thiz, thiz->root, alphas);
+    if (!thiz->automata_open)
+        return 0; /* already finalized, compiled or loaded */
+
+    if (ac_automata_bfs_setfailure (thiz))
+        return -1;
 
     for (i=0; i < thiz->all_nodes_num; i++)
     {
         node = thiz->all_nodes[i];
-        ac_automata_union_matchstrs (node);
         node_sort_edges (node);
+        if (node_compact (node, thiz->pool))
+            AC_ERROR("ac_automata_finalize: can't compact node %d\n", node->id);
     }
     thiz->automata_open = 0; /* do not accept patterns any more */
+    return 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_compile
+ * Compile the finalized automata into a transition table (see actable.h).
+ * the trie nodes are released afterwards, ac_automata_search() and
+ * ac_automata_findnext() use the table.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * RETURN VALUE:
+ * -1: failed; automata is not finalized or out of memory
+ *  0: success
+******************************************************************************/
+int ac_automata_compile (AC_AUTOMATA_t * thiz)
+{
+    if (thiz->automata_open)
+        return -1;
+
+    if (thiz->table)
+        return 0;
+
+    thiz->table = ac_table_compile (thiz);
+    if (!thiz->table)
+        return -1;
+
+    ac_automata_release_nodes (thiz);
+    ac_automata_reset (thiz);
+    return 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_load
+ * Make finalized automata from a compiled table image (see ac_table_save()).
+ * the image is used in place and is not copied, it must stay valid and
+ * unchanged until the automata is released; ac_automata_release() does not
+ * release it.
+ * PARAMS:
+ * const void * image: table image, aligned to sizeof(long)
+ * unsigned long size: size of the image in bytes
+ * RETURN VALUE:
+ * automata or NULL if the image is invalid or out of memory
+******************************************************************************/
+AC_AUTOMATA_t * ac_automata_load (const void * image, unsigned long size)
+{
+    AC_AUTOMATA_t * thiz;
+    struct ac_table_state * states;
+    unsigned int i;
+
+    if (ac_table_check (image, size))
+        return NULL;
+
+    thiz = (AC_AUTOMATA_t *)malloc(sizeof(AC_AUTOMATA_t));
+    if (!thiz)
+        return NULL;
+    memset (thiz, 0, sizeof(AC_AUTOMATA_t));
+    thiz->table = (AC_TABLE_t *) image;
+    thiz->table_borrowed = 1;
+    thiz->ignorecase = (thiz->table->flags & AC_TABLE_IGNORECASE) != 0;
+    thiz->total_patterns = thiz->table->patterns_num;
+    states = AC_TABLE_STATES(thiz->table);
+    for (i = 0; i < thiz->table->states_num; i++)
+        if (states[i].depth > thiz->max_length)
+            thiz->max_length = states[i].depth;
+    ac_automata_reset (thiz);
+    return thiz;
 }
 
 /******************************************************************************
@@ -187,29 +288,264 @@ void ac_automata_finalize (AC_AUTOMATA_t * thiz)
 int ac_automata_search (AC_AUTOMATA_t * thiz, AC_TEXT_t * text, int keep, 
         AC_MATCH_CALBACK_f callback, void * param)
 {
-    unsigned long position;
-    AC_NODE_t * current_ac;
-    AC_NODE_t * next;
-    AC_MATCH_t match;
+    thiz->text = 0;
+    thiz->output_node = 0;
+    thiz->output_state = 0;
+
+    return ac_automata_search_cursor (thiz, &thiz->cursor, text, keep,
+            callback, param);
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_mode
+ * Set match semantics of ac_automata_search(), see AC_MATCH_MODE_t. cursors
+ * of ac_automata_search_cursor() have their own 'mode'. the settext/findnext
+ * mode and ac_automata_search_mask() always report all matches.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_MATCH_MODE_t mode: match semantics
+******************************************************************************/
+void ac_automata_mode (AC_AUTOMATA_t * thiz, AC_MATCH_MODE_t mode)
+{
+    thiz->cursor.mode = mode;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_cursor_reset
+ * reset the cursor and make it ready for doing new search on a new text with
+ * the given automata.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_CURSOR_t * cursor: the pointer to the cursor
+******************************************************************************/
+void ac_automata_cursor_reset (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor)
+{
+    cursor->current_node = thiz->root;
+    cursor->current_state = 0;
+    cursor->base_position = 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_cursor_state
+ * Number of the current state of the cursor: the BFS index of the node, the
+ * same as the state of the compiled table. with the stream position it is
+ * enough to continue the search later by ac_automata_cursor_set().
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_CURSOR_t * cursor: the pointer to the cursor
+******************************************************************************/
+unsigned int ac_automata_cursor_state (AC_AUTOMATA_t * thiz,
+        AC_CURSOR_t * cursor)
+{
+    if (thiz->table)
+        return cursor->current_state;
+    return cursor->current_node->state;
+}
 
+/******************************************************************************
+ * FUNCTION: ac_automata_cursor_set
+ * Restore the cursor state saved by ac_automata_cursor_state(), the mode of
+ * the cursor is not changed.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_CURSOR_t * cursor: the pointer to the cursor
+ * unsigned int state: state number of the same automata
+ * unsigned long position: stream position of the next chunk
+ * RETURN VALUE:
+ * -1: failed; automata is not finalized or the state is out of range
+ *  0: success
+******************************************************************************/
+int ac_automata_cursor_set (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor,
+        unsigned int state, unsigned long position)
+{
+    if (thiz->automata_open)
+        return -1;
+
+    if (thiz->table)
+    {
+        if (state >= thiz->table->states_num)
+            return -1;
+        cursor->current_state = state;
+    }
+    else
+    {
+        if (!thiz->all_nodes || state >= thiz->all_nodes_num)
+            return -1;
+        cursor->current_node = thiz->all_nodes[state];
+    }
+    cursor->base_position = position;
+    return 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_search_cursor
+ * Same as ac_automata_search(), but the search state is kept in the given
+ * cursor and the automata is not modified, so several cursors can search
+ * with one finalized automata at the same time.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_CURSOR_t * cursor: the pointer to the search state
+ * see ac_automata_search() for other params and return values.
+******************************************************************************/
+int ac_automata_search_cursor (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor,
+        AC_TEXT_t * text, int keep, AC_MATCH_CALBACK_f callback, void * param)
+{
     if (thiz->automata_open)
         /* you must call ac_automata_locate_failure() first */
         return -1;
-    
-    thiz->text = 0;
 
     if (!keep)
-        ac_automata_reset(thiz);
-        
+        ac_automata_cursor_reset(thiz, cursor);
+
+    if (cursor->mode != AC_MATCH_ALL)
+    {
+        if (thiz->table)
+            return ac_table_search_mode (thiz->table, cursor, text,
+                    callback, param);
+        return ac_automata_search_nodes_mode (thiz, cursor, text,
+                callback, param);
+    }
+
+    if (thiz->table)
+        return ac_table_search (thiz->table, cursor, text, callback, param);
+
+    return ac_automata_search_nodes (thiz, cursor, text, NULL, callback, param);
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_search_batch
+ * Searches several independent texts, each one as ac_automata_search_cursor()
+ * with keep set, its own cursor and call-back param. with AC_MATCH_ALL
+ * cursors up to AC_TABLE_BATCH texts are advanced in turn, so the cache
+ * misses of the texts overlap (see ac_table_search_batch()). with other
+ * modes texts are searched one after another.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_CURSOR_t ** cursors: search states of texts
+ * AC_TEXT_t * texts: the input texts
+ * unsigned int num: number of texts
+ * AC_MATCH_CALBACK_f callback: call-back function for matches
+ * void ** params: call-back params of texts
+ * RETURN VALUE:
+ * -1: failed; automata is not finalized
+ * >= 0: number of texts whose search was stopped by the call-back
+******************************************************************************/
+int ac_automata_search_batch (AC_AUTOMATA_t * thiz, AC_CURSOR_t ** cursors,
+        AC_TEXT_t * texts, unsigned int num, AC_MATCH_CALBACK_f callback,
+        void ** params)
+{
+    unsigned int i;
+    int stopped = 0;
+
+    if (thiz->automata_open)
+        return -1;
+
+    for (i = 0; i < num; i++)
+        if (cursors[i]->mode != AC_MATCH_ALL)
+            break;
+    if (i == num)
+    {
+        if (thiz->table)
+            return ac_table_search_batch (thiz->table, cursors, texts, num,
+                    callback, params);
+        return ac_automata_search_nodes_batch (thiz, cursors, texts, num,
+                callback, params);
+    }
+
+    for (i = 0; i < num; i++)
+        if (ac_automata_search_cursor (thiz, cursors[i], &texts[i], 1,
+                    callback, params[i]) == 1)
+            stopped++;
+    return stopped;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_mask
+ * Set masks of the finalized automata nodes (see AC_NODE_t.mask), so
+ * ac_automata_search_mask() can skip final nodes without interesting
+ * patterns. it must be called before ac_automata_compile(), the compiled
+ * table keeps the masks.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * AC_PATTERN_MASK_f pattern_mask: returns mask of a pattern
+ * void * param: this parameter will be send to pattern_mask
+ * RETURN VALUE:
+ * -1: failed; automata is not finalized or already compiled
+ *  0: success
+******************************************************************************/
+int ac_automata_mask (AC_AUTOMATA_t * thiz, AC_PATTERN_MASK_f pattern_mask,
+        void * param)
+{
+    unsigned int i, j;
+    AC_NODE_t * node;
+
+    if (thiz->automata_open || !thiz->all_nodes)
+        return -1;
+
+    /* BFS order: the output node is shallower, its mask is already set */
+    for (i = 0; i < thiz->all_nodes_num; i++)
+    {
+        node = thiz->all_nodes[i];
+        node->mask = node->output_node ? node->output_node->mask : 0;
+        for (j = 0; j < node->matched_patterns_num; j++)
+            node->mask |= pattern_mask(&node->matched_patterns[j], param);
+    }
+    return 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_search_mask
+ * Same as ac_automata_search_cursor(), but the call-back function is called
+ * only at the positions where the node mask set by ac_automata_mask()
+ * intersects the given mask. the match has all patterns of the position as
+ * usually. e.g. search for the first pattern of a group can skip positions
+ * with patterns of other groups only.
+ * PARAMS:
+ * unsigned long mask: report positions with these mask bits only
+ * see ac_automata_search_cursor() for other params and return values.
+******************************************************************************/
+int ac_automata_search_mask (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor,
+        AC_TEXT_t * text, int keep, unsigned long mask,
+        AC_MATCH_CALBACK_f callback, void * param)
+{
+    if (thiz->automata_open)
+        return -1;
+
+    if (!keep)
+        ac_automata_cursor_reset(thiz, cursor);
+
+    if (thiz->table)
+        return ac_table_search_mask (thiz->table, cursor, text, mask,
+                callback, param);
+
+    return ac_automata_search_nodes (thiz, cursor, text, &mask, callback, param);
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_search_nodes
+ * Search loop of the automata that is not compiled. reports positions of
+ * all final nodes if mask is NULL, otherwise positions of nodes with the
+ * mask bits only.
+******************************************************************************/
+static int ac_automata_search_nodes (AC_AUTOMATA_t * thiz,
+        AC_CURSOR_t * cursor, AC_TEXT_t * text, const unsigned long * mask,
+        AC_MATCH_CALBACK_f callback, void * param)
+{
+    unsigned long position;
+    AC_NODE_t * current_ac;
+    AC_NODE_t * next;
+    AC_NODE_t * m;
+    AC_MATCH_t match;
+
     position = 0;
-    current_ac = thiz->current_node;
+    current_ac = cursor->current_node;
 
     /* This is the main search loop.
      * it must be as lightweight as possible. */
     while (position < text->length)
     {
 	char c = text->astring[position];
-	if(thiz->ignorecase && c>65 && c<90)
+	if(thiz->ignorecase && c>=65 && c<=90)
 		c+=32;
         if ( !(next = node_findbs_next(current_ac, c)))
         {
@@ -223,25 +559,211 @@ int ac_automata_search (AC_AUTOMATA_t * thiz, AC_TEXT_t * text, int keep,
             current_ac = next;
             position++;
         }
-		if(current_ac != current_ac->failure_node)
 
-        if (current_ac->final && next)
+        if ((mask ? (current_ac->mask & *mask) :
+                    (current_ac->final || current_ac->output_node)) && next)
         /* We check 'next' to find out if we came here after a alphabet
          * transition or due to a fail. in second case we should not report
          * matching because it was reported in previous node */
         {
-            match.position = position + thiz->base_position;
-            match.match_num = current_ac->matched_patterns_num;
-            match.patterns = current_ac->matched_patterns;
-            /* we found a match! do call-back */
-            if (callback(&match, param))
-                return -1;
+            match.position = position + cursor->base_position;
+            /* report own patterns of the node and of every final node on
+             * its output chain */
+            m = current_ac->final ? current_ac : current_ac->output_node;
+            for (; m; m = m->output_node)
+            {
+                match.match_num = m->matched_patterns_num;
+                match.patterns = m->matched_patterns;
+                /* we found a match! do call-back */
+                if (callback(&match, param))
+                    return 1;
+            }
         }
     }
 
     /* save status variables */
-    thiz->current_node = current_ac;
-    thiz->base_position += position;
+    cursor->current_node = current_ac;
+    cursor->base_position += position;
+    return 0;
+}
+
+/* Text searched by ac_automata_search_nodes_batch() */
+struct ac_nodes_lane
+{
+    const AC_ALPHABET_t * astring;
+    unsigned long length;
+    unsigned long position;
+    AC_NODE_t * node;
+    unsigned int text; /* Index of the text in the batch */
+};
+
+/******************************************************************************
+ * FUNCTION: ac_automata_search_nodes_batch
+ * Search loop of the automata that is not compiled for several texts, see
+ * ac_table_search_batch(). a lane makes one step of ac_automata_search_nodes()
+ * loop in turn, a transition or a failure, and prefetches the node it moved
+ * to.
+******************************************************************************/
+static int ac_automata_search_nodes_batch (AC_AUTOMATA_t * thiz,
+        AC_CURSOR_t ** cursors, AC_TEXT_t * texts, unsigned int num,
+        AC_MATCH_CALBACK_f callback, void ** params)
+{
+    struct ac_nodes_lane lanes[AC_TABLE_BATCH];
+    struct ac_nodes_lane * l;
+    unsigned int active = 0, next_text = 0, stopped = 0;
+    unsigned int i;
+    AC_NODE_t * next;
+    AC_NODE_t * m;
+    AC_MATCH_t match;
+    int stop;
+    char c;
+
+    for (;;)
+    {
+        /* fill free lanes, empty texts are done at once */
+        while (active < AC_TABLE_BATCH && next_text < num)
+        {
+            if (!texts[next_text].length)
+            {
+                next_text++;
+                continue;
+            }
+            l = &lanes[active++];
+            l->astring = texts[next_text].astring;
+            l->length = texts[next_text].length;
+            l->position = 0;
+            l->node = cursors[next_text]->current_node;
+            l->text = next_text++;
+        }
+        if (!active)
+            break;
+
+        for (i = 0; i < active; i++)
+        {
+            l = &lanes[i];
+            c = l->astring[l->position];
+            if (thiz->ignorecase && c>=65 && c<=90)
+                c += 32;
+            if (!(next = node_findbs_next(l->node, c)))
+            {
+                if (l->node->failure_node)
+                    l->node = l->node->failure_node;
+                else
+                    l->position++;
+            }
+            else
+            {
+                l->node = next;
+                l->position++;
+            }
+            AC_PREFETCH(l->node);
+
+            stop = 0;
+            if ((l->node->final || l->node->output_node) && next)
+            {
+                match.position = l->position + cursors[l->text]->base_position;
+                m = l->node->final ? l->node : l->node->output_node;
+                for (; m; m = m->output_node)
+                {
+                    match.match_num = m->matched_patterns_num;
+                    match.patterns = m->matched_patterns;
+                    if (callback(&match, params[l->text]))
+                    {
+                        stop = 1;
+                        break;
+                    }
+                }
+            }
+            if (stop)
+                stopped++;
+            else if (l->position < l->length)
+                continue;
+            else
+            {
+                cursors[l->text]->current_node = l->node;
+                cursors[l->text]->base_position += l->length;
+            }
+            /* the text is done, the last lane takes its place */
+            *l = lanes[--active];
+            i--;
+        }
+    }
+    return stopped;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_search_nodes_mode
+ * Search loop of the automata that is not compiled for AC_MATCH_LONGEST and
+ * AC_MATCH_LEFTMOST_LONGEST modes, see ac_table_search_mode().
+******************************************************************************/
+static int ac_automata_search_nodes_mode (AC_AUTOMATA_t * thiz,
+        AC_CURSOR_t * cursor, AC_TEXT_t * text,
+        AC_MATCH_CALBACK_f callback, void * param)
+{
+    unsigned long position = 0;
+    unsigned long end, start;
+    unsigned long pending_start = 0, pending_end = 0;
+    AC_NODE_t * pending = NULL; /* final node of the chosen match */
+    AC_NODE_t * current_ac = cursor->current_node;
+    AC_NODE_t * next;
+    AC_NODE_t * m;
+    AC_MATCH_t match;
+
+    for (;;)
+    {
+        while (position < text->length)
+        {
+            char c = text->astring[position++];
+            if(thiz->ignorecase && c>=65 && c<=90)
+                c+=32;
+            while (!(next = node_findbs_next(current_ac, c)) &&
+                    current_ac->failure_node)
+                current_ac = current_ac->failure_node;
+            if (next)
+                current_ac = next;
+            end = position + cursor->base_position;
+
+            /* no match found later can start at or before the chosen one */
+            if (pending && end - current_ac->depth > pending_start)
+                break;
+
+            m = current_ac->final ? current_ac : current_ac->output_node;
+            if (!m || !next)
+                continue;
+            if (cursor->mode == AC_MATCH_LONGEST)
+            {
+                match.position = end;
+                match.match_num = m->matched_patterns_num;
+                match.patterns = m->matched_patterns;
+                if (callback(&match, param))
+                    return 1;
+                continue;
+            }
+            /* the same start with a later end is longer */
+            start = end - m->depth;
+            if (!pending || start <= pending_start)
+            {
+                pending = m;
+                pending_start = start;
+                pending_end = end;
+            }
+        }
+
+        if (!pending)
+            break;
+        match.position = pending_end;
+        match.match_num = pending->matched_patterns_num;
+        match.patterns = pending->matched_patterns;
+        if (callback(&match, param))
+            return 1;
+        /* the next match starts after this one: search again from its end */
+        current_ac = thiz->root;
+        position = pending_end - cursor->base_position;
+        pending = NULL;
+    }
+
+    cursor->current_node = current_ac;
+    cursor->base_position += position;
     return 0;
 }
 
@@ -254,6 +776,8 @@ void ac_automata_settext (AC_AUTOMATA_t * thiz, AC_TEXT_t * text, int keep)
     if (!keep)
         ac_automata_reset(thiz);
     thiz->position = 0;
+    thiz->output_node = 0;
+    thiz->output_state = 0;
 }
 
 /******************************************************************************
@@ -271,9 +795,23 @@ AC_MATCH_t * ac_automata_findnext (AC_AUTOMATA_t * thiz)
     
     if (!thiz->text)
         return 0;
-    
+
+    if (thiz->table)
+        return ac_table_findnext (thiz->table, &thiz->cursor, thiz->text,
+                &thiz->position, &thiz->output_state);
+
+    /* Finish the output chain of the previous match first */
+    if (thiz->output_node)
+    {
+        match.position = thiz->position + thiz->cursor.base_position;
+        match.match_num = thiz->output_node->matched_patterns_num;
+        match.patterns = thiz->output_node->matched_patterns;
+        thiz->output_node = thiz->output_node->output_node;
+        return &match;
+    }
+
     position = thiz->position;
-    current_ac = thiz->current_node;
+    current_ac = thiz->cursor.current_node;
     match.match_num = 0;
 
     /* This is the main search loop.
@@ -293,27 +831,29 @@ AC_MATCH_t * ac_automata_findnext (AC_AUTOMATA_t * thiz)
             position++;
         }
 
-        if (current_ac->final && next)
+        if ((current_ac->final || current_ac->output_node) && next)
         /* We check 'next' to find out if we came here after a alphabet
          * transition or due to a fail. in second case we should not report
          * matching because it was reported in previous node */
         {
-            match.position = position + thiz->base_position;
-            match.match_num = current_ac->matched_patterns_num;
-            match.patterns = current_ac->matched_patterns;
+            next = current_ac->final ? current_ac : current_ac->output_node;
+            match.position = position + thiz->cursor.base_position;
+            match.match_num = next->matched_patterns_num;
+            match.patterns = next->matched_patterns;
+            thiz->output_node = next->output_node;
             break;
         }
     }
 
     /* save status variables */
-    thiz->current_node = current_ac;
+    thiz->cursor.current_node = current_ac;
     thiz->position = position;
     
     if (!match.match_num)
         /* if we came here due to reaching to the end of input text
          * not a loop break
          */
-        thiz->base_position += position;
+        thiz->cursor.base_position += position;
     
     return match.match_num?&match:0;
 }
@@ -328,8 +868,34 @@ AC_MATCH_t * ac_automata_findnext (AC_AUTOMATA_t * thiz)
 ******************************************************************************/
 void ac_automata_reset (AC_AUTOMATA_t * thiz)
 {
-    thiz->current_node = thiz->root;
-    thiz->base_position = 0;
+    ac_automata_cursor_reset(thiz, &thiz->cursor);
+    thiz->output_node = 0;
+    thiz->output_state = 0;
+}
+
+/******************************************************************************
+ * FUNCTION: ac_automata_memory
+ * Memory used by the automata in bytes. 'nodes' is the trie nodes with
+ * their BFS array, 'edges' is the rest of the trie pool: edges, pattern
+ * lists and pattern strings. the trie is released by ac_automata_compile(),
+ * then the table is the whole automata.
+ * PARAMS:
+ * AC_AUTOMATA_t * thiz: the pointer to the automata
+ * unsigned long * nodes, * edges, * table: memory of the parts
+******************************************************************************/
+void ac_automata_memory (AC_AUTOMATA_t * thiz, unsigned long * nodes,
+        unsigned long * edges, unsigned long * table)
+{
+    *nodes = 0;
+    *edges = 0;
+    if (thiz->pool)
+    {
+        *nodes = thiz->all_nodes_num * sizeof(AC_NODE_t);
+        *edges = mpool_size(thiz->pool) - *nodes;
+        if (thiz->all_nodes)
+            *nodes += thiz->all_nodes_num * sizeof(AC_NODE_t *);
+    }
+    *table = thiz->table ? thiz->table->size : 0;
 }
 
 /******************************************************************************
@@ -340,18 +906,27 @@ void ac_automata_reset (AC_AUTOMATA_t * thiz)
 ******************************************************************************/
 void ac_automata_release (AC_AUTOMATA_t * thiz)
 {
-    unsigned int i;
-    AC_NODE_t * n;
-
-    for (i=0; i < thiz->all_nodes_num; i++)
-    {
-        n = thiz->all_nodes[i];
-        node_release(n);
-    }
-    free(thiz->all_nodes);
+    if (thiz->pool)
+        ac_automata_release_nodes(thiz);
+    if (thiz->table && !thiz->table_borrowed)
+        ac_table_release(thiz->table);
     free(thiz);
 }
 
+/******************************************************************************
+ * FUNCTION: ac_automata_release_nodes
+ * Release the trie nodes of the automata
+******************************************************************************/
+static void ac_automata_release_nodes (AC_AUTOMATA_t * thiz)
+{
+    mpool_free(thiz->pool);
+    thiz->pool = NULL;
+    ac_vfree(thiz->all_nodes);
+    thiz->all_nodes = NULL;
+    thiz->all_nodes_num = 0;
+    thiz->root = NULL;
+}
+
 /******************************************************************************
  * FUNCTION: ac_automata_display
  * Prints the automata to output in human readable form. it is useful for
@@ -367,13 +942,21 @@ void ac_automata_display (AC_AUTOMATA_t * thiz, char repcast)
     struct edge * e;
     AC_PATTERN_t sid;
 
+    if (thiz->table)
+    {
+        ac_table_display(thiz->table);
+        return;
+    }
+
     AC_PRINT("---------------------------------\n");
 
-    for (i=0; i<thiz->all_nodes_num; i++)
+    for (i=0; thiz->all_nodes && i<thiz->all_nodes_num; i++)
     {
         n = thiz->all_nodes[i];
         AC_PRINT("NODE(%3d)/----fail----> NODE(%3d)\n",
                 n->id, (n->failure_node)?n->failure_node->id:1);
+        if (n->output_node)
+            AC_PRINT("         \\---output--> NODE(%3d)\n", n->output_node->id);
         for (j=0; j<n->outgoing_degree; j++)
         {
             e = &n->outgoing[j];
@@ -407,91 +990,58 @@ void ac_automata_display (AC_AUTOMATA_t * thiz, char repcast)
 }
 
 /******************************************************************************
- * FUNCTION: ac_automata_register_nodeptr
- * Adds the node pointer to all_nodes.
+ * FUNCTION: ac_automata_bfs_setfailure
+ * Traverse all automata nodes using BFS (Breadth First Search), meanwhile it
+ * set the failure node and the output node for every node it passes through.
+ * the failure node of a child is found from the failure node of its parent,
+ * which is already set because it is closer to the root, so the whole pass
+ * is linear in the number of nodes. the BFS queue is kept as all_nodes and
+ * every node gets its index in it. this function must be called after adding last pattern to
+ * automata. i.e. after calling this you can not add further pattern to
+ * automata.
+ * RETURN VALUE: 0 on success, -1 if the queue can't be allocated
 ******************************************************************************/
-static void ac_automata_register_nodeptr (AC_AUTOMATA_t * thiz, AC_NODE_t * node)
+static int ac_automata_bfs_setfailure (AC_AUTOMATA_t * thiz)
 {
-	/* TODO: memory reallocation */
-	/*
-    if(thiz->all_nodes_num >= thiz->all_nodes_max)
-    {
-        thiz->all_nodes_max += REALLOC_CHUNK_ALLNODES;
-        thiz->all_nodes = realloc
-                (thiz->all_nodes, thiz->all_nodes_max*sizeof(AC_NODE_t *));
-    }
-	*/
-    thiz->all_nodes[thiz->all_nodes_num++] = node;
-}
-
-/******************************************************************************
- * FUNCTION: ac_automata_union_matchstrs
- * Collect accepted patterns of the node. the accepted patterns consist of the
- * node's own accepted pattern plus accepted patterns of its failure node.
-******************************************************************************/
-static void ac_automata_union_matchstrs (AC_NODE_t * node)
-{
-    unsigned int i;
-    AC_NODE_t * m = node;
+    unsigned int i, head, tail;
+    AC_NODE_t ** queue;
+    AC_NODE_t * node;
+    AC_NODE_t * next;
+    AC_NODE_t * m;
+    AC_NODE_t * fail;
+    AC_ALPHABET_t alpha;
 
-    while ((m = m->failure_node))
+    queue = (AC_NODE_t **) ac_vmalloc (thiz->all_nodes_num * sizeof(AC_NODE_t *));
+    if (!queue)
     {
-        for (i=0; i < m->matched_patterns_num; i++)
-            node_register_matchstr(node, &(m->matched_patterns[i]));
-
-        if (m->final)
-            node->final = 1;
+        AC_ERROR("ac_automata_bfs_setfailure: can't allocate queue\n");
+        return -1;
     }
-    // TODO : sort matched_patterns? is that necessary? I don't think so.
-}
 
-/******************************************************************************
- * FUNCTION: ac_automata_set_failure
- * find failure node for the given node.
-******************************************************************************/
-static void ac_automata_set_failure
-    (AC_AUTOMATA_t * thiz, AC_NODE_t * node, AC_ALPHABET_t * alphas)
-{
-    unsigned int i, j;
-    AC_NODE_t * m;
-
-    for (i=1; i < node->depth; i++)
+    head = tail = 0;
+    thiz->root->state = tail;
+    queue[tail++] = thiz->root;
+    while (head < tail)
     {
-        m = thiz->root;
-        for (j=i; j < node->depth && m; j++)
-            m = node_find_next (m, alphas[j]);
-        if (m)
+        node = queue[head++];
+        for (i=0; i < node->outgoing_degree; i++)
         {
-            node->failure_node = m;
-            break;
+            alpha = node->outgoing[i].alpha;
+            next = node->outgoing[i].next;
+            next->state = tail;
+            queue[tail++] = next;
+
+            /* Follow failure chain of the parent until some node has
+             * transition for the same alpha */
+            fail = NULL;
+            for (m = node->failure_node; m && !fail; m = m->failure_node)
+                fail = node_find_next (m, alpha);
+            next->failure_node = fail ? fail : thiz->root;
+            next->output_node = next->failure_node->final ?
+                next->failure_node : next->failure_node->output_node;
         }
     }
-    if (!node->failure_node)
-        node->failure_node = thiz->root;
-}
 
-/******************************************************************************
- * FUNCTION: ac_automata_traverse_setfailure
- * Traverse all automata nodes using DFS (Depth First Search), meanwhile it set
- * the failure node for every node it passes through. this function must be
- * called after adding last pattern to automata. i.e. after calling this you
- * can not add further pattern to automata.
-******************************************************************************/
-static void ac_automata_traverse_setfailure
-    (AC_AUTOMATA_t * thiz, AC_NODE_t * node, AC_ALPHABET_t * alphas)
-{
-    unsigned int i;
-    AC_NODE_t * next;
-
-    for (i=0; i < node->outgoing_degree; i++)
-    {
-        alphas[node->depth] = node->outgoing[i].alpha;
-        next = node->outgoing[i].next;
-
-        /* At every node look for its failure node */
-        ac_automata_set_failure (thiz, next, alphas);
-
-        /* Recursively call itself to traverse all nodes */
-        ac_automata_traverse_setfailure (thiz, next, alphas);
-    }
+    thiz->all_nodes = queue;
+    return 0;
 }
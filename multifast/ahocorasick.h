@@ -28,18 +28,36 @@ extern "C" {
 #endif
 
 struct AC_NODE;
+struct AC_TABLE;
+
+/* AC_CURSOR_t:
+ * Search state of one input stream. it is kept apart from the automata, so
+ * a finalized automata is read-only during search and can be shared by any
+ * number of concurrent searches, each with its own cursor.
+**/
+typedef struct AC_CURSOR
+{
+    struct AC_NODE * current_node; /* Pointer to current node while searching */
+    unsigned int current_state; /* Current state while searching compiled table */
+    unsigned long base_position; /* Represents the position of current chunk
+                                  * related to whole input text */
+    AC_MATCH_MODE_t mode; /* Match semantics, kept by cursor reset */
+} AC_CURSOR_t;
 
 typedef struct AC_AUTOMATA
 {
     /* The root of the Aho-Corasick trie */
     struct AC_NODE * root;
 
-    /* maintain all nodes pointers. it will be used to access or release
-    * all nodes. */
+    /* Memory pool of nodes, edges and matched patterns arrays. it is
+     * released at once by ac_automata_release() */
+    struct mpool * pool;
+
+    /* maintain all nodes pointers in BFS order, filled by
+     * ac_automata_finalize(). it will be used to access all nodes. */
     struct AC_NODE ** all_nodes;
 
     unsigned int all_nodes_num; /* Number of all nodes in the automata */
-    unsigned int all_nodes_max; /* Current max allocated memory for *all_nodes */
 
     /* this flag indicates that if automata is finalized by
      * ac_automata_finalize() or not. 1 means finalized and 0
@@ -50,10 +68,8 @@ typedef struct AC_AUTOMATA
     /* It is possible to feed a large input to the automata chunk by chunk to
      * be searched using ac_automata_search(). in fact by default automata
      * thinks that all chunks are related unless you do ac_automata_reset().
-     * followings are variables that keep track of searching state. */
-    struct AC_NODE * current_node; /* Pointer to current node while searching */
-    unsigned long base_position; /* Represents the position of current chunk
-                                  * related to whole input text */
+     * the cursor keeps track of searching state. */
+    AC_CURSOR_t cursor;
 
     /* The input text.
      * used only when it is working in settext/findnext mode */
@@ -63,25 +79,54 @@ typedef struct AC_AUTOMATA
      * used only when it is working in settext/findnext mode */
     unsigned long position;
 
+    /* Next node (state in compiled table) of the output chain to report.
+     * used only when it is working in settext/findnext mode */
+    struct AC_NODE * output_node;
+    unsigned int output_state;
+
     /* Case unsensitive search in automata */
     int ignorecase;
+
+    /* Compiled transition table made by ac_automata_compile(). once it is
+     * built the trie nodes are released and all searches go through it */
+    struct AC_TABLE * table;
+
+    /* The table is an image given to ac_automata_load(), owned by caller */
+    unsigned short table_borrowed;
     
     /* Statistic Variables */
     
     /* Total patterns in the automata */
     unsigned long total_patterns;
+
+    /* Length of the longest pattern (depth of the deepest state) */
+    unsigned int max_length;
     
 } AC_AUTOMATA_t;
 
 
 AC_AUTOMATA_t * ac_automata_init     (int ignorecase);
 AC_STATUS_t     ac_automata_add      (AC_AUTOMATA_t * thiz, AC_PATTERN_t * str);
-void            ac_automata_finalize (AC_AUTOMATA_t * thiz);
+int             ac_automata_finalize (AC_AUTOMATA_t * thiz);
+int             ac_automata_compile  (AC_AUTOMATA_t * thiz);
+AC_AUTOMATA_t * ac_automata_load     (const void * image, unsigned long size);
 int             ac_automata_search   (AC_AUTOMATA_t * thiz, AC_TEXT_t * text, int keep, AC_MATCH_CALBACK_f callback, void * param);
 
+void            ac_automata_mode     (AC_AUTOMATA_t * thiz, AC_MATCH_MODE_t mode);
+
+void            ac_automata_cursor_reset (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor);
+unsigned int    ac_automata_cursor_state (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor);
+int             ac_automata_cursor_set (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor, unsigned int state, unsigned long position);
+int             ac_automata_search_cursor (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor, AC_TEXT_t * text, int keep, AC_MATCH_CALBACK_f callback, void * param);
+int             ac_automata_search_batch (AC_AUTOMATA_t * thiz, AC_CURSOR_t ** cursors, AC_TEXT_t * texts, unsigned int num, AC_MATCH_CALBACK_f callback, void ** params);
+
+int             ac_automata_mask     (AC_AUTOMATA_t * thiz, AC_PATTERN_MASK_f pattern_mask, void * param);
+int             ac_automata_search_mask (AC_AUTOMATA_t * thiz, AC_CURSOR_t * cursor, AC_TEXT_t * text, int keep, unsigned long mask, AC_MATCH_CALBACK_f callback, void * param);
+
 void            ac_automata_settext  (AC_AUTOMATA_t * thiz, AC_TEXT_t * text, int keep);
 AC_MATCH_t *    ac_automata_findnext (AC_AUTOMATA_t * thiz);
 
+void            ac_automata_memory   (AC_AUTOMATA_t * thiz, unsigned long * nodes, unsigned long * edges, unsigned long * table);
 void            ac_automata_release  (AC_AUTOMATA_t * thiz);
 void            ac_automata_display  (AC_AUTOMATA_t * thiz, char repcast);
 
@@ -0,0 +1,164 @@
+/*
+ * mpool.c: implementation of memory pool (arena)
+ * This file is part of modified multifast.
+ *
+    Copyright 2015 Ilya Gavrilov <gilyav@gmail.com>
+
+    multifast is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    multifast is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with multifast.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __KERNEL__
+#include <stdlib.h>
+#include <string.h>
+#endif
+
+#ifdef __KERNEL__
+#include <linux/slab.h>
+#endif
+
+#include "mpool.h"
+#include "ac_module.h"
+
+#define malloc(x) ac_malloc(x)
+#define free(x) ac_free(x)
+
+/* Alignment of allocated chunks */
+#define MPOOL_ALIGN(x) (((x) + sizeof(long) - 1) & ~(sizeof(long) - 1))
+
+/* Block of the pool, the chunks follow the header */
+struct mpool_block
+{
+    struct mpool_block * next; /* Previously allocated block */
+    size_t size; /* Usable size of the block */
+    size_t used; /* Bytes given out from the block */
+};
+
+struct mpool
+{
+    struct mpool_block * block; /* Current block, the head of block list */
+    size_t block_size; /* Usable size of a regular block */
+    size_t total; /* Bytes allocated for all blocks */
+};
+
+#define MPOOL_BLOCK_HDR MPOOL_ALIGN(sizeof(struct mpool_block))
+
+/* Private function prototype */
+static struct mpool_block * mpool_new_block (struct mpool * thiz, size_t size);
+
+
+/******************************************************************************
+ * FUNCTION: mpool_create
+ * Create the memory pool
+ * PARAMS:
+ * size_t block_size: usable size of a block, 0 for MPOOL_BLOCK_SIZE
+******************************************************************************/
+struct mpool * mpool_create (size_t block_size)
+{
+    struct mpool * thiz;
+
+    thiz = (struct mpool *) malloc (sizeof(struct mpool));
+    if (!thiz)
+        return NULL;
+    thiz->block = NULL;
+    thiz->block_size = block_size ? block_size : MPOOL_BLOCK_SIZE - MPOOL_BLOCK_HDR;
+    thiz->total = sizeof(struct mpool);
+    return thiz;
+}
+
+/******************************************************************************
+ * FUNCTION: mpool_new_block
+ * Allocate new block with at least 'size' usable bytes and link it to the pool
+******************************************************************************/
+static struct mpool_block * mpool_new_block (struct mpool * thiz, size_t size)
+{
+    struct mpool_block * block;
+
+    block = (struct mpool_block *) malloc (MPOOL_BLOCK_HDR + size);
+    if (!block)
+        return NULL;
+    block->size = size;
+    block->used = 0;
+    thiz->total += MPOOL_BLOCK_HDR + size;
+    return block;
+}
+
+/******************************************************************************
+ * FUNCTION: mpool_malloc
+ * Allocate 'size' bytes from the pool. chunks larger than a quarter of the
+ * block get a block of their own, which is linked behind the current block
+ * so the free space of the current block is not wasted.
+******************************************************************************/
+void * mpool_malloc (struct mpool * thiz, size_t size)
+{
+    struct mpool_block * block;
+
+    size = MPOOL_ALIGN(size);
+
+    if (size > thiz->block_size / 4)
+    {
+        block = mpool_new_block(thiz, size);
+        if (!block)
+            return NULL;
+        block->used = size;
+        if (thiz->block)
+        {
+            block->next = thiz->block->next;
+            thiz->block->next = block;
+        }
+        else
+        {
+            block->next = NULL;
+            thiz->block = block;
+        }
+        return (char *)block + MPOOL_BLOCK_HDR;
+    }
+
+    block = thiz->block;
+    if (!block || block->size - block->used < size)
+    {
+        block = mpool_new_block(thiz, thiz->block_size);
+        if (!block)
+            return NULL;
+        block->next = thiz->block;
+        thiz->block = block;
+    }
+
+    block->used += size;
+    return (char *)block + MPOOL_BLOCK_HDR + block->used - size;
+}
+
+/******************************************************************************
+ * FUNCTION: mpool_free
+ * Release the pool and all memory allocated from it
+******************************************************************************/
+void mpool_free (struct mpool * thiz)
+{
+    struct mpool_block * block;
+
+    while ((block = thiz->block))
+    {
+        thiz->block = block->next;
+        free(block);
+    }
+    free(thiz);
+}
+
+/******************************************************************************
+ * FUNCTION: mpool_size
+ * Returns number of bytes allocated by the pool
+******************************************************************************/
+size_t mpool_size (struct mpool * thiz)
+{
+    return thiz->total;
+}
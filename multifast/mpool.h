@@ -0,0 +1,55 @@
+/*
+ * mpool.h: memory pool (arena) header file
+ * This file is part of modified multifast.
+ *
+    Copyright 2015 Ilya Gavrilov <gilyav@gmail.com>
+
+    multifast is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    multifast is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with multifast.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MPOOL_H_
+#define _MPOOL_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stddef.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default size of a memory pool block */
+#ifndef MPOOL_BLOCK_SIZE
+#define MPOOL_BLOCK_SIZE 8192
+#endif
+
+/* Memory pool:
+ * bump allocator of the automata. nodes, edges and pattern lists are cut from
+ * large blocks, nothing is freed separately and the whole pool is released
+ * at once by mpool_free().
+**/
+struct mpool;
+
+struct mpool * mpool_create (size_t block_size);
+void *         mpool_malloc (struct mpool * thiz, size_t size);
+void           mpool_free   (struct mpool * thiz);
+size_t         mpool_size   (struct mpool * thiz);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,6 +27,7 @@
 #ifdef __KERNEL__
 #include <linux/slab.h>
 #include <linux/sort.h>
+#include <linux/bitops.h>
 #define AC_ERROR(x...) printk(x)
 #define AC_PRINT(x...) printk(x)
 #define AC_DEBUG(x...) printk(x)
@@ -39,37 +40,52 @@
 #endif
 
 #include "node.h"
+#include "mpool.h"
 #include "ac_module.h"
 
-#define malloc(x) ac_malloc(x)
-#define free(x) ac_free(x)
-
-/* reallocation step for AC_NODE_t.matched_patterns */
+/* initial size of AC_NODE_t.matched_patterns, it is doubled on overflow */
 #ifndef REALLOC_CHUNK_MATCHSTR
-#define REALLOC_CHUNK_MATCHSTR 100
+#define REALLOC_CHUNK_MATCHSTR 1
 #endif
 
-/* reallocation step for AC_NODE_t.outgoing array */
-#define REALLOC_CHUNK_OUTGOING 100
-/* For different node depth, number of outgoing edges differs considerably 
- * if you care about preprocessing speed, you can set a higher value for 
- * reallocation step size to prevent multiple reallocations.
+/* initial size of AC_NODE_t.outgoing array, it is doubled on overflow */
+#define REALLOC_CHUNK_OUTGOING 2
+/* Most of nodes are single child tails of patterns, so arrays start small.
+ * all arrays are cut from the automata memory pool: a grown array leaves the
+ * old one in the pool until the automata is released, which is bounded by
+ * the size of the final array because of doubling.
  */
 
+#ifdef __KERNEL__
+#define node_popcount(x) hweight64(x)
+#define node_ctz(x) __ffs64(x)
+#else
+#define node_popcount(x) __builtin_popcountll(x)
+#define node_ctz(x) __builtin_ctzll(x)
+#endif
+
+#define NODE_ONES 0x0101010101010101ULL
+#define NODE_HIGHS 0x8080808080808080ULL
+
 /* Private function prototype */
 void node_init         (AC_NODE_t * thiz);
 int  node_edge_compare (const void * l, const void * r);
 int  node_has_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * newstr);
+void * node_grow       (void * array, unsigned short * max, unsigned short num,
+                        size_t size, unsigned short chunk, struct mpool * pool);
 
 
 /******************************************************************************
  * FUNCTION: node_create
- * Create the node
+ * Create the node in the memory pool. the node is released together with
+ * the pool.
 ******************************************************************************/
-struct AC_NODE * node_create(void)
+struct AC_NODE * node_create(struct mpool * pool)
 {
     AC_NODE_t * thiz;
-    thiz = (AC_NODE_t *) malloc (sizeof(AC_NODE_t));
+    thiz = (AC_NODE_t *) mpool_malloc (pool, sizeof(AC_NODE_t));
+    if (!thiz)
+        return NULL;
     node_init(thiz);
     node_assign_id(thiz);
     return thiz;
@@ -77,30 +93,40 @@ struct AC_NODE * node_create(void)
 
 /******************************************************************************
  * FUNCTION: node_init
- * Initialize node
+ * Initialize node. edges and patterns arrays are allocated on first use.
 ******************************************************************************/
 void node_init(AC_NODE_t * thiz)
 {
     memset(thiz, 0, sizeof(AC_NODE_t));
-
-    thiz->outgoing_max = REALLOC_CHUNK_OUTGOING;
-    thiz->outgoing = (struct edge *) malloc
-            (thiz->outgoing_max*sizeof(struct edge));
-
-    thiz->matched_patterns_max = REALLOC_CHUNK_MATCHSTR;
-    thiz->matched_patterns = (AC_PATTERN_t *) malloc
-            (thiz->matched_patterns_max*sizeof(AC_PATTERN_t));
 }
 
 /******************************************************************************
- * FUNCTION: node_release
- * Release node
+ * FUNCTION: node_grow
+ * Make room for one more element in the node array. returns the (possibly
+ * moved) array or NULL if it can't be allocated.
 ******************************************************************************/
-void node_release(AC_NODE_t * thiz)
+void * node_grow (void * array, unsigned short * max, unsigned short num,
+        size_t size, unsigned short chunk, struct mpool * pool)
 {
-    free(thiz->matched_patterns);
-    free(thiz->outgoing);
-    free(thiz);
+    void * grown;
+    unsigned int new_max;
+
+    if (num < *max)
+        return array;
+
+    new_max = *max ? *max * 2 : chunk;
+    if (new_max > 0xffff)
+        new_max = 0xffff;
+    if (new_max <= num)
+        return NULL;
+
+    grown = mpool_malloc (pool, new_max * size);
+    if (!grown)
+        return NULL;
+    if (num)
+        memcpy(grown, array, num * size);
+    *max = new_max;
+    return grown;
 }
 
 /******************************************************************************
@@ -124,12 +150,40 @@ AC_NODE_t * node_find_next(AC_NODE_t * thiz, AC_ALPHABET_t alpha)
 /******************************************************************************
  * FUNCTION: node_findbs_next
  * Find out the next node for a given Alpha. this function is used after the
- * pre-processing stage in which we sort edges. so it uses Binary Search.
+ * pre-processing stage in which we sort edges and choose representation of
+ * the node. nodes which are not compacted use Binary Search.
 ******************************************************************************/
 AC_NODE_t * node_findbs_next (AC_NODE_t * thiz, AC_ALPHABET_t alpha)
 {
     int min, max, mid;
     AC_ALPHABET_t amid;
+    unsigned char c = (unsigned char) alpha;
+    unsigned long long x;
+    struct node_bitmap * bm;
+
+    switch (thiz->type)
+    {
+    case AC_NODE_ONE:
+        return thiz->edges.one.alpha == alpha ? thiz->edges.one.next : NULL;
+
+    case AC_NODE_SMALL:
+        /* find zero byte of the xor: lowest flagged byte is the first match */
+        x = thiz->edges.small ^ (NODE_ONES * c);
+        x = (x - NODE_ONES) & ~x & NODE_HIGHS;
+        if (!x)
+            return NULL;
+        return thiz->outgoing[node_ctz(x) >> 3].next;
+
+    case AC_NODE_BITMAP:
+        bm = thiz->edges.bitmap;
+        x = 1ULL << (c & 63);
+        if (!(bm->bits[c >> 6] & x))
+            return NULL;
+        return bm->next[bm->rank[c >> 6] + node_popcount(bm->bits[c >> 6] & (x - 1))];
+
+    case AC_NODE_DENSE:
+        return thiz->edges.dense[c];
+    }
 
     min = 0;
     max = thiz->outgoing_degree - 1;
@@ -179,7 +233,7 @@ int node_has_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * newstr)
  * FUNCTION: node_create_next
  * Create the next node for the given alpha.
 ******************************************************************************/
-AC_NODE_t * node_create_next (AC_NODE_t * thiz, AC_ALPHABET_t alpha)
+AC_NODE_t * node_create_next (AC_NODE_t * thiz, AC_ALPHABET_t alpha, struct mpool * pool)
 {
     AC_NODE_t * next;
     next = node_find_next (thiz, alpha);
@@ -187,8 +241,11 @@ AC_NODE_t * node_create_next (AC_NODE_t * thiz, AC_ALPHABET_t alpha)
     /* The edge already exists */
         return NULL;
     /* Otherwise register new edge */
-    next = node_create ();
-    node_register_outgoing(thiz, next, alpha);
+    next = node_create (pool);
+    if (!next)
+        return NULL;
+    if (node_register_outgoing(thiz, next, alpha, pool))
+        return NULL;
 
     return next;
 }
@@ -196,51 +253,56 @@ AC_NODE_t * node_create_next (AC_NODE_t * thiz, AC_ALPHABET_t alpha)
 /******************************************************************************
  * FUNCTION: node_register_matchstr
  * Adds the pattern to the list of accepted pattern.
+ * returns 0 on success, -1 if out of memory
 ******************************************************************************/
-void node_register_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * str)
+int node_register_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * str, struct mpool * pool)
 {
+    AC_PATTERN_t * patterns;
+
     /* Check if the new pattern already exists in the node list */
     if (node_has_matchstr(thiz, str))
-        return;
+        return 0;
 
     /* Manage memory */
-    if (thiz->matched_patterns_num >= thiz->matched_patterns_max)
+    patterns = (AC_PATTERN_t *) node_grow (thiz->matched_patterns,
+            &thiz->matched_patterns_max, thiz->matched_patterns_num,
+            sizeof(AC_PATTERN_t), REALLOC_CHUNK_MATCHSTR, pool);
+    if (!patterns)
     {
-		/* TODO: memory reallocation */
-		/*
-        thiz->matched_patterns_max += REALLOC_CHUNK_MATCHSTR;
-        thiz->matched_patterns = (AC_PATTERN_t *) realloc 
-            (thiz->matched_patterns, thiz->matched_patterns_max*sizeof(AC_PATTERN_t));
-			*/
-		AC_ERROR("Error node_has_matchstr: matched_patterns_num too big\n");
+        AC_ERROR("Error node_register_matchstr: can't allocate matched_patterns\n");
+        return -1;
     }
+    thiz->matched_patterns = patterns;
 
     thiz->matched_patterns[thiz->matched_patterns_num].astring = str->astring;
     thiz->matched_patterns[thiz->matched_patterns_num].length = str->length;
     thiz->matched_patterns[thiz->matched_patterns_num].rep = str->rep;
     thiz->matched_patterns_num++;
+    return 0;
 }
 
 /******************************************************************************
  * FUNCTION: node_register_outgoing
  * Establish an edge between two nodes
+ * returns 0 on success, -1 if out of memory
 ******************************************************************************/
-void node_register_outgoing
-    (AC_NODE_t * thiz, AC_NODE_t * next, AC_ALPHABET_t alpha)
+int node_register_outgoing
+    (AC_NODE_t * thiz, AC_NODE_t * next, AC_ALPHABET_t alpha, struct mpool * pool)
 {
-    if(thiz->outgoing_degree >= thiz->outgoing_max)
+    struct edge * outgoing;
+
+    outgoing = (struct edge *) node_grow (thiz->outgoing, &thiz->outgoing_max,
+            thiz->outgoing_degree, sizeof(struct edge), REALLOC_CHUNK_OUTGOING, pool);
+    if (!outgoing)
     {
-		/* TODO: memory reallocation */
-		/*
-        thiz->outgoing_max += REALLOC_CHUNK_OUTGOING;
-        thiz->outgoing = (struct edge *) realloc 
-            (thiz->outgoing, thiz->outgoing_max*sizeof(struct edge));
-			*/
-		AC_ERROR("Error node_register_outgoing: outgoing_degree too big\n");
+        AC_ERROR("Error node_register_outgoing: can't allocate outgoing\n");
+        return -1;
     }
+    thiz->outgoing = outgoing;
 
     thiz->outgoing[thiz->outgoing_degree].alpha = alpha;
     thiz->outgoing[thiz->outgoing_degree++].next = next;
+    return 0;
 }
 
 /******************************************************************************
@@ -280,6 +342,8 @@ int node_edge_compare (const void * l, const void * r)
 ******************************************************************************/
 void node_sort_edges (AC_NODE_t * thiz)
 {
+    if (thiz->outgoing_degree < 2)
+        return;
 #ifndef __KERNEL__
     qsort ((void *)thiz->outgoing, thiz->outgoing_degree, sizeof(struct edge),
             node_edge_compare);
@@ -288,3 +352,76 @@ void node_sort_edges (AC_NODE_t * thiz)
             node_edge_compare, NULL);
 #endif
 }
+
+/******************************************************************************
+ * FUNCTION: node_compact
+ * Choose search representation of the node by its outgoing degree and depth.
+ * must be called after node_sort_edges(). the outgoing array is kept for the
+ * other users (failure links, compiled table, display).
+ * returns 0 on success, -1 if out of memory (node keeps binary search)
+******************************************************************************/
+int node_compact (AC_NODE_t * thiz, struct mpool * pool)
+{
+    unsigned int i, w;
+    unsigned char c;
+    struct node_bitmap * bm;
+
+    if (thiz->depth == 0 ||
+            (thiz->depth <= AC_NODE_DENSE_DEPTH &&
+             thiz->outgoing_degree >= AC_NODE_DENSE_DEGREE))
+    {
+        thiz->edges.dense = (AC_NODE_t **) mpool_malloc (pool, 256 * sizeof(AC_NODE_t *));
+        if (!thiz->edges.dense)
+            return -1;
+        memset(thiz->edges.dense, 0, 256 * sizeof(AC_NODE_t *));
+        for (i = 0; i < thiz->outgoing_degree; i++)
+            thiz->edges.dense[(unsigned char)thiz->outgoing[i].alpha] =
+                thiz->outgoing[i].next;
+        thiz->type = AC_NODE_DENSE;
+    }
+    else if (thiz->outgoing_degree == 0)
+    {
+        thiz->type = AC_NODE_EDGES;
+    }
+    else if (thiz->outgoing_degree == 1)
+    {
+        thiz->edges.one.alpha = thiz->outgoing[0].alpha;
+        thiz->edges.one.next = thiz->outgoing[0].next;
+        thiz->type = AC_NODE_ONE;
+    }
+    else if (thiz->outgoing_degree <= AC_NODE_SMALL_MAX)
+    {
+        thiz->edges.small = 0;
+        for (i = 0; i < AC_NODE_SMALL_MAX; i++)
+        {
+            c = thiz->outgoing[i < thiz->outgoing_degree ? i : thiz->outgoing_degree - 1].alpha;
+            thiz->edges.small |= (unsigned long long) c << (i * 8);
+        }
+        thiz->type = AC_NODE_SMALL;
+    }
+    else
+    {
+        bm = (struct node_bitmap *) mpool_malloc (pool, sizeof(struct node_bitmap) +
+                thiz->outgoing_degree * sizeof(AC_NODE_t *));
+        if (!bm)
+            return -1;
+        memset(bm, 0, sizeof(struct node_bitmap));
+        for (i = 0; i < thiz->outgoing_degree; i++)
+        {
+            c = thiz->outgoing[i].alpha;
+            bm->bits[c >> 6] |= 1ULL << (c & 63);
+        }
+        for (w = 1; w < 4; w++)
+            bm->rank[w] = bm->rank[w - 1] + node_popcount(bm->bits[w - 1]);
+        for (i = 0; i < thiz->outgoing_degree; i++)
+        {
+            c = thiz->outgoing[i].alpha;
+            bm->next[bm->rank[c >> 6] +
+                node_popcount(bm->bits[c >> 6] & ((1ULL << (c & 63)) - 1))] =
+                thiz->outgoing[i].next;
+        }
+        thiz->edges.bitmap = bm;
+        thiz->type = AC_NODE_BITMAP;
+    }
+    return 0;
+}
@@ -29,6 +29,21 @@ extern "C" {
 
 /* Forward Declaration */
 struct edge;
+struct mpool;
+struct node_bitmap;
+
+/* Representations of outgoing edges, chosen by node_compact() at finalize
+ * time according to the node fan-out */
+#define AC_NODE_EDGES   0 /* Sorted edges array, binary search */
+#define AC_NODE_ONE     1 /* Single edge stored in the node */
+#define AC_NODE_SMALL   2 /* Up to AC_NODE_SMALL_MAX alphas packed in a word */
+#define AC_NODE_BITMAP  3 /* 256 bit map of alphas, popcount rank of the next */
+#define AC_NODE_DENSE   4 /* 256 entries next nodes row */
+
+#define AC_NODE_SMALL_MAX    8  /* Max outgoing degree of AC_NODE_SMALL */
+#define AC_NODE_DENSE_DEPTH  1  /* Max depth of AC_NODE_DENSE nodes... */
+#define AC_NODE_DENSE_DEGREE 32 /* ...with at least this outgoing degree. the
+                                 * root is always AC_NODE_DENSE */
 
 /* automata node */
 typedef struct AC_NODE
@@ -36,9 +51,16 @@ typedef struct AC_NODE
     int id; /* Node ID : for debugging purpose */
     short int final; /* 0: no ; 1: yes, it is a final node */
     struct AC_NODE * failure_node; /* The failure node of this node */
+    struct AC_NODE * output_node; /* The nearest final node on the failure
+                                   * chain (dictionary suffix link) */
     unsigned short depth; /* depth: distance between this node and the root */
+    unsigned int state; /* Index in all_nodes of the finalized automata (BFS
+                         * order), also the state number in compiled table */
+    unsigned long mask; /* OR of masks of the patterns matched at this node,
+                         * own and on output chain (see ac_automata_mask) */
 
-    /* Matched patterns */
+    /* Matched patterns: own patterns of the node only, patterns of the
+     * failure chain are found by following output_node */
     AC_PATTERN_t * matched_patterns; /* Array of matched patterns */
     unsigned short matched_patterns_num; /* Number of matched patterns at this node */
     unsigned short matched_patterns_max; /* Max capacity of allocated memory for matched_patterns */
@@ -47,6 +69,21 @@ typedef struct AC_NODE
     struct edge * outgoing; /* Array of outgoing edges */
     unsigned short outgoing_degree; /* Number of outgoing edges */
     unsigned short outgoing_max; /* Max capacity of allocated memory for outgoing */
+
+    /* Search representation of outgoing edges */
+    unsigned char type; /* AC_NODE_* */
+    union
+    {
+        struct
+        {
+            AC_ALPHABET_t alpha;
+            struct AC_NODE * next;
+        } one; /* AC_NODE_ONE */
+        unsigned long long small; /* AC_NODE_SMALL: alphas of outgoing, one
+                                   * per byte, padded with the last alpha */
+        struct node_bitmap * bitmap; /* AC_NODE_BITMAP */
+        struct AC_NODE ** dense; /* AC_NODE_DENSE: indexed by byte value */
+    } edges;
 } AC_NODE_t;
 
 /* The Edge of the Node */
@@ -56,16 +93,24 @@ struct edge
     AC_NODE_t * next; /* Target of the edge */
 };
 
+/* AC_NODE_BITMAP edges */
+struct node_bitmap
+{
+    unsigned long long bits[4]; /* Bit per byte value of existing edges */
+    unsigned short rank[4]; /* Number of edges in the preceding words */
+    AC_NODE_t * next[]; /* Next nodes in byte value order */
+};
+
 
-AC_NODE_t * node_create            (void);
-AC_NODE_t * node_create_next       (AC_NODE_t * thiz, AC_ALPHABET_t alpha);
-void        node_register_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * str);
-void        node_register_outgoing (AC_NODE_t * thiz, AC_NODE_t * next, AC_ALPHABET_t alpha);
+AC_NODE_t * node_create            (struct mpool * pool);
+AC_NODE_t * node_create_next       (AC_NODE_t * thiz, AC_ALPHABET_t alpha, struct mpool * pool);
+int         node_register_matchstr (AC_NODE_t * thiz, AC_PATTERN_t * str, struct mpool * pool);
+int         node_register_outgoing (AC_NODE_t * thiz, AC_NODE_t * next, AC_ALPHABET_t alpha, struct mpool * pool);
 AC_NODE_t * node_find_next         (AC_NODE_t * thiz, AC_ALPHABET_t alpha);
 AC_NODE_t * node_findbs_next       (AC_NODE_t * thiz, AC_ALPHABET_t alpha);
-void        node_release           (AC_NODE_t * thiz);
 void        node_assign_id         (AC_NODE_t * thiz);
 void        node_sort_edges        (AC_NODE_t * thiz);
+int         node_compact           (AC_NODE_t * thiz, struct mpool * pool);
 
 #ifdef __cplusplus
 }